@@ -1,68 +1,700 @@
 #include "stdbool.h"
 #include "stdlib.h"
+#include "stddef.h"
 #include "math.h"
 #include "string.h"
 #include "stdio.h"
 
+#ifdef HOST_BUILD
+#include "pthread.h"
+#include "signal.h"
+#include "time.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/wait.h"
+#include "fcntl.h"
+#define main chat_main // The simulator's own main starts each board
+#endif
+
 /* GLOBAL REGISTER DEFINITIONS */
 #define LED_BASE 0xFF200000
+#define GPIO_CTRL_BASE 0xFF200060
 #define GPIO_BASE 0xFF200070
 #define PS2_BASE 0xFF200100
 #define PIXEL_BUFFER_BASE 0xFF203020
 #define CHARACTER_BUFFER_BASE 0xFF203030
+#define TIMER_BASE 0xFF202000
+#define TIMER2_BASE 0xFF202020
+#define JTAG_UART_BASE 0xFF201000
 
 /* MISC DEFINITIONS */
+#define CPU_MHZ 100
 #define BUFFER_SIZE 256
+#define TIMER_IRQ 0
+#define TIMER2_IRQ 2
 #define PS2_IRQ 7
-#define GPIO_IRQ 12
+#define GPIO_IRQ 11 // Raised by the strobe input on GPIO_CTRL_BASE
+#define RX_RING_SIZE 1024 // Must be a power of two
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+#define KB_RING_SIZE 64 // Must be a power of two
+#define KB_RING_MASK (KB_RING_SIZE - 1)
+#define TX_RING_SIZE 2048 // Must be a power of two, more than TX_WINDOW full frames
+#define TX_RING_MASK (TX_RING_SIZE - 1)
+#define TX_BYTE_PERIOD 2000 // Timer cycles between transmitted bytes
+
+/* LINK WIRING DEFINITIONS */
+// Data travels on GPIO_BASE and the strobe on GPIO_CTRL_BASE. Both cables are
+// crossed so output bit n drives input bit n + 8 on the other board. With a
+// 16-bit link the second byte uses output bits 16-23 and input bits 24-31.
+#define LINK_WIDTH 16 // Data bits per transfer, 8 or 16
+#define LINK_LANES (LINK_WIDTH / 8)
+#if LINK_WIDTH == 16
+#define LINK_DATA_OUT_MASK 0x00FF00FF
+#else
+#define LINK_DATA_OUT_MASK 0x000000FF
+#endif
+#define LINK_STROBE_OUT 0x001 // Toggled once per transfer
+#define LINK_ACK_OUT 0x002	  // Toggled once per transfer taken in
+#define LINK_WIDE_OUT 0x004	  // Set when the second byte lane is valid
+#define LINK_CTRL_OUT_MASK (LINK_STROBE_OUT | LINK_ACK_OUT | LINK_WIDE_OUT)
+#define LINK_STROBE_IN 0x100
+#define LINK_ACK_IN 0x200
+#define LINK_WIDE_IN 0x400
+
+// With the handshake, the next transfer goes out as soon as the peer toggles
+// its acknowledge line, and the receiver holds the acknowledge back while its
+// ring is full. Without it, transfers are paced by the interval timer.
+#define LINK_HANDSHAKE 1
+#define LINK_ACK_TIMEOUT 5000000 // Timer cycles before a missing peer is given up on
+#define LINK_ACK_WAITS 20		 // Timeouts waited out while connected, for a peer short of ring space
+
+/* LINK FRAME DEFINITIONS */
+// Frame layout: SYNC TYPE LENGTH SEQ PAYLOAD[LENGTH] CRC_HI CRC_LO, with a
+// CRC-16/CCITT over TYPE through the end of the payload
+#define FRAME_SYNC 0x7E
+#define FRAME_HEADER_SIZE 4
+#define FRAME_OVERHEAD 6
+#define FRAME_MAX_PAYLOAD 255
+#define FRAME_HELLO 0x01	   // Payload is the HELLO header and the sender's user name, SEQ is 0
+#define FRAME_MESSAGE 0x02 // Payload is a chat message
+#define FRAME_ACK 0x03	   // No payload, SEQ is the next frame the sender of the ACK expects
+#define FRAME_TYPING_INSERT 0x04 // Payload is a position and the character typed there
+#define FRAME_TYPING_DELETE 0x05 // Payload is the position of the character removed
+#define FRAME_TYPING_COMMIT 0x06 // No payload, the line built from the edits is a message
+#define FRAME_HELLO_ACK 0x07 // Answers a FRAME_HELLO, with the same payload layout
+#define FRAME_HEARTBEAT 0x08 // No payload, sent when the link has been quiet
+#define FRAME_PACKED 0x80  // Type flag: payload is 6-bit packed text
+
+/* RELIABLE DELIVERY DEFINITIONS */
+// Message and typing frames are kept until the peer acknowledges them, with up
+// to TX_WINDOW on the link at once. The receiver only takes frames in
+// sequence and answers each one with a cumulative FRAME_ACK. Without an ACK
+// before the timeout, every unacknowledged frame is sent again (go-back-N)
+// and the timeout doubles, up to RETRANSMIT_MAX_TICKS. Repeated ACKs for the
+// same frame mean the frames after it arrived without it, so it is resent
+// straight away.
+#define TX_SLOTS 16 // Must be a power of two; frames waiting or in flight
+#define TX_SLOT_MASK (TX_SLOTS - 1)
+#define TX_WINDOW 4
+#define RETRANSMIT_TICKS 100
+#define RETRANSMIT_MAX_TICKS 1600
+#define REPEATED_ACKS 2 // Repeats of an ACK before resending without waiting
+#define RX_STALL_TICKS 50 // Link quiet this long means a partial frame never will complete
+
+/* CONNECTION DEFINITIONS */
+// Once it has a name, a board that is not connected sends a FRAME_HELLO every
+// HELLO_TICKS. The payload starts with the protocol version, the sender's
+// session number, the peer session it knows, the next sequence number it
+// will send and the next one it expects. The peer answers with a
+// FRAME_HELLO_ACK, and nothing but hellos goes out until then. While
+// connected, a FRAME_HEARTBEAT is sent whenever nothing else has been for
+// HEARTBEAT_TICKS, and hearing nothing for LINK_TIMEOUT_TICKS drops the link.
+// The session number is picked once, with the name, so a peer that has been
+// reset shows up as a new session and is the only case where the expected
+// sequence number is taken from the hello. A peer that only lost the link
+// carries on, and its expected number acknowledges what already arrived, so
+// nothing is delivered twice.
+#define PROTOCOL_VERSION 3
+#define HELLO_HEADER_SIZE 7
+#define HELLO_TICKS 200
+#define HEARTBEAT_TICKS 250
+#define LINK_TIMEOUT_TICKS 1000
+
+/* PACKED TEXT DEFINITIONS */
+// Text is sent as 6-bit symbols, most significant bit first. Capitals are
+// PACK6_UPPER followed by the lowercase letter, other characters outside the
+// alphabet are PACK6_ESCAPE followed by the raw 8 bits, and the last byte is
+// padded with ones so padding never decodes as a symbol.
+#define PACK6_ALPHABET " abcdefghijklmnopqrstuvwxyz0123456789.',`-=[];/*\\+!?:\"()@#&_<>"
+#define PACK6_UPPER 62
+#define PACK6_ESCAPE 63
+#define PACK6_UPPER_FLAG 0x40 // Set in pack6_symbol for capitals
+
+/* KEY DEFINITIONS */
+// Keys are reported as ASCII where one exists; the rest use codes above 0x7F
+#define KEY_BACKSPACE 0x08
+#define KEY_ENTER 0x10
+#define KEY_ESC 0x1B
+#define KEY_UP 0x80
+#define KEY_DOWN 0x81
+#define KEY_LEFT 0x82
+#define KEY_RIGHT 0x83
+#define KEY_HOME 0x84
+#define KEY_END 0x85
+#define KEY_DELETE 0x86
+#define KEY_PAGE_UP 0x87
+#define KEY_PAGE_DOWN 0x88
+#define KEY_INSERT 0x89
+#define KEY_F1 0x91 // F1 to F12 are KEY_F1 + n - 1
+#define KEY_F12 0x9C
+
+/* EVENT DEFINITIONS */
+// The ISRs post events and the main loop idles until one arrives. A type is
+// queued at most once at a time, so the queue can never overflow.
+#define EVENT_KEY 0	  // Scan codes waiting in kb_ring
+#define EVENT_RX 1	  // Bytes waiting in rx_ring
+#define EVENT_BLINK 2 // Cursor blink period elapsed
+#define EVENT_LINK 3  // A hello or heartbeat is due, or the peer has gone quiet
+#define EVENT_TICK 4  // Tick while a redraw waits for a free back buffer
+#define EVENT_RETRANSMIT 5 // The oldest unacknowledged frame timed out
+#define EVENT_PROFILE 6 // F2 dump output waiting for the JTAG UART
+#define EVENT_RING_SIZE 8 // Must be a power of two, more than the number of types
+#define EVENT_RING_MASK (EVENT_RING_SIZE - 1)
+#define TICK_PERIOD 100000 // TIMER2 cycles per tick, 1 ms at 100 MHz
+#define TICKS_PER_SECOND 1000
+#define BLINK_TICKS 500
+
+/* PROFILING DEFINITIONS */
+// Latency histograms with one bucket per power of two cycles. Build with
+// -DPROFILE=0 to compile all of it out.
+#ifndef PROFILE
+#define PROFILE 1
+#endif
+#define HIST_IRQ_LATENCY 0 // Tick timeout to tick_ISR
+#define HIST_HANDLER 1	   // Whole interrupt_handler call
+#define HIST_PS2_ISR 2
+#define HIST_GPIO_ISR 3
+#define HIST_TIMER_ISR 4
+#define HIST_TICK_ISR 5
+#define HIST_FRAME 6		 // redraw_dirty and initial_setup
+#define HIST_KEY_TO_SCREEN 7 // Scan code in to the frame showing it swapped in
+#define HIST_COUNT 8
+#define HIST_BUCKETS 32
+#define PROFILE_OUT_SIZE 8192 // Must be a power of two
+#define PROFILE_OUT_MASK (PROFILE_OUT_SIZE - 1)
+
+#if PROFILE
+#define PROFILE_START(name) unsigned int name = read_cycles()
+#define PROFILE_END(hist, name) profile_record(hist, read_cycles() - (name))
+#define PROFILE_RECORD(hist, cycles) profile_record(hist, cycles)
+#else
+#define PROFILE_START(name)
+#define PROFILE_END(hist, name)
+#define PROFILE_RECORD(hist, cycles)
+#endif
+
+/* MESSAGE STORE DEFINITIONS */
+// Messages are variable-length records in one ring arena, evicted oldest
+// first. Records are rounded to RECORD_ALIGN so the space left at the end of
+// the arena always fits a padding record. The text is followed by its
+// word-wrap layout, one MessageLine per screen row.
+#define ARENA_SIZE 262144 // Several thousand short messages
+#define RECORD_ALIGN 8
+#define RECORD_HEADER_SIZE offsetof(struct MessageRecord, text)
+#define RECORD_MAX_SIZE ((RECORD_HEADER_SIZE + FRAME_MAX_PAYLOAD + 1 + MAX_MESSAGE_LINES * sizeof(struct MessageLine) + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1))
+#define RECORD_PAD 0x01			 // Record flag: unused space at the end of the arena
+#define MESSAGE_INDEX_SIZE 16384 // Must be a power of two, at least ARENA_SIZE / 16
+#define MESSAGE_INDEX_MASK (MESSAGE_INDEX_SIZE - 1)
+#define MAX_SENDERS 8
+#define SENDER_NAME_SIZE 64
+#define SENDER_SHOWN 20 // Longer names are cut short on screen
+
+/* CHAT LOG DEFINITIONS */
+// Messages are also appended to a log in a part of SDRAM the program does not
+// otherwise use, which keeps its contents through a reset. Records are
+// checksummed and end with a copy of their size, so the newest can be found by
+// walking back from the end offset in the header. The header only moves past a
+// record once it is written, so a reset during an append leaves the record
+// out. A full log starts again at the front, over the oldest records.
+#define LOG_BASE 0x83E00000 // 1 MB below the top megabyte of SDRAM, where the stack is; bit 31 bypasses the data cache
+#define LOG_SIZE 0x100000
+#define LOG_SCRATCH_BASE (LOG_BASE - LOG_SIZE) // The megabyte below, for benchmark_log to fill
+#define LOG_MAGIC 0x43424C47
+#define LOG_RECORD_MAGIC 0x4C52
+#define LOG_RESTORE_MESSAGES ((VIEW_ROWS + 1) / 2) // A message takes at least two rows, so this fills the view
+
+/* SEARCH DEFINITIONS */
+// Every stored message is indexed by the trigrams of its text, ignoring case.
+// Postings are taken from a ring in message order and each bucket chains its
+// own newest first. The store evicts old messages to keep the postings of
+// every live message in the ring, so the index never outgrows it.
+#define TRIGRAM_BUCKETS 4096 // Must be a power of two
+#define TRIGRAM_MASK (TRIGRAM_BUCKETS - 1)
+#define POSTING_POOL_SIZE 131072 // Must be a power of two, below POSTING_NONE
+#define POSTING_MASK (POSTING_POOL_SIZE - 1)
+#define POSTING_NONE 0xFFFFFFFF
+#define MAX_MESSAGE_POSTINGS (FRAME_MAX_PAYLOAD - 2)
+#define SEARCH_MAX_LENGTH 32
+#define SEARCH_MAX_RESULTS 64
+#define SEARCH_HIGHLIGHT 0x4200 // Behind the rows of matching messages
+
+/* SCROLLBACK DEFINITIONS */
+// Messages are laid out on a virtual column of rows counted from the first
+// message ever stored: a blank separator row followed by the wrapped text.
+// The view shows VIEW_ROWS of them, ending scroll_offset rows above the newest.
+#define VIEW_TOP_ROW 7
+#define VIEW_ROWS 45 // Rows 7 to 51
+#define PAGE_ROWS (VIEW_ROWS - 4)
+#define TEXT_COLUMN 2
+#define TEXT_WIDTH 76 // Columns 2 to 77
+#define WRAP_INDENT 4 // Continuation lines start this far in
+// "name >> " takes at most 24 columns, so each pair of wrapped lines holds more
+// than 52 characters and a full payload needs at most 11 lines
+#define MAX_MESSAGE_LINES 12
+#define PREVIEW_ROW 53 // The line the peer is typing, in live typing mode
+
+/* SCREEN DEFINITIONS */
+#define SCREEN_WIDTH 320
+#define SCREEN_HEIGHT 240
+
+#define CHAR_COLUMNS 80
+#define CHAR_ROWS 60
+
+/* GLYPH DEFINITIONS */
+// A 3x5 font drawn in 4-pixel cells, so pixel text lines up with the
+// character columns. Glyphs are rasterized once per colour pair into a cache
+// of ready-made pixel rows.
+#define GLYPH_WIDTH 4
+#define GLYPH_HEIGHT 5
+#define GLYPH_CACHE_SIZE 256 // Must be a power of two
+#define GLYPH_CACHE_MASK (GLYPH_CACHE_SIZE - 1)
+#define INPUT_HIGHLIGHT 0x10A6 // Background of the text being typed
+
+/* SCREEN REGIONS */
+// Each region covers a band of character rows and the matching pixel rows
+// (a character cell is 4x4 pixels in the 320x240 pixel buffer)
+#define REGION_HEADER 0x1
+#define REGION_MESSAGES 0x2
+#define REGION_INPUT 0x4
+#define REGION_HUD 0x8		// Character rows 3 and 4 of the header, no pixels
+#define REGION_PREVIEW 0x10 // PREVIEW_ROW of the messages, no pixels
+#define REGION_ALL (REGION_HEADER | REGION_MESSAGES | REGION_INPUT | REGION_HUD | REGION_PREVIEW)
+
+/* HARDWARE ACCESS */
+// Device registers are only touched through IO_READ and IO_WRITE, so the host
+// build can play the devices. Frame buffer memory is still written directly.
+#ifdef HOST_BUILD
+int sim_read(volatile int *reg);
+void sim_write(volatile int *reg, int value);
+void sim_write_status(int status);
+void sim_write_ienable(int ienable);
+int sim_read_ipending(void);
+extern int sim_status;
+extern int sim_ienable;
+extern char *sim_log_area;
+extern char *sim_log_scratch;
+void sim_rx_delay(void);
+#define IO_READ(reg) sim_read(reg)
+#define IO_WRITE(reg, value) sim_write(reg, value)
+#define LOG_HOME sim_log_area
+#define LOG_SCRATCH sim_log_scratch
+#define RX_DELAY() sim_rx_delay() // The host build can play a slow receiver
+#else
+#define IO_READ(reg) (*(reg))
+#define IO_WRITE(reg, value) (*(reg) = (value))
+#define LOG_HOME ((char *)LOG_BASE)
+#define LOG_SCRATCH ((char *)LOG_SCRATCH_BASE)
+#define RX_DELAY()
+#endif
+#define LOG_AREA log_area
 
 /* GLOBAL IO POINTERS */
+volatile int *const GPIO_CTRL_PTR = (int *)GPIO_CTRL_BASE;
 volatile int *const GPIO_PTR = (int *)GPIO_BASE;
 volatile int *const PS2_PTR = (int *)PS2_BASE;
 volatile int *const LED_PTR = (int *)LED_BASE;
 volatile int *const PIXEL_PTR = (int *)PIXEL_BUFFER_BASE;
 volatile int *const CHARACTER_PTR = (int *)CHARACTER_BUFFER_BASE;
+volatile int *const TIMER2_PTR = (int *)TIMER2_BASE;
+volatile int *const JTAG_UART_PTR = (int *)JTAG_UART_BASE;
 
 /* GLOBAL STRUCTS */
-// Defining struct for a message
-struct Message
+// Defining struct for a message record in the arena
+struct MessageRecord
+{
+	unsigned short size;  // Arena bytes taken, header included
+	unsigned char sender; // Index into sender_names
+	unsigned char flags;
+	unsigned int id;
+	unsigned char length;	  // Text bytes, without the terminator
+	unsigned char line_count; // Screen rows of text, MessageLines after the text
+	char text[];			  // Null-terminated
+};
+
+// One wrapped row of a message, as a span of its text
+struct MessageLine
+{
+	unsigned char start;
+	unsigned char length;
+};
+
+// Frame kept for retransmission until it is acknowledged
+struct TxSlot
+{
+	unsigned char type;
+	unsigned char length;
+	char payload[FRAME_MAX_PAYLOAD];
+};
+
+// One message in one trigram's chain
+struct Posting
+{
+	unsigned int id;
+	unsigned short trigram;
+	unsigned int next; // Older posting with the same trigram, or POSTING_NONE
+};
+
+// Start of the chat log area
+struct LogHeader
 {
-	char user_name[256];
-	char message[256];
-	int y_location;
+	unsigned int magic;
+	unsigned int end;	   // Offset just past the newest record
+	unsigned int wrap_end; // Where the records stopped when the log last started again at the front
 };
 
-// Defining struct for linked list
-struct MessageNode
+// One message in the chat log, followed by the size again in its last 4 bytes
+struct LogRecord
 {
-	struct Message message;
-	struct Message *next;
+	unsigned short magic;
+	unsigned short size; // Whole record, a multiple of 4
+	unsigned int seq;	 // Counts up by one per record
+	unsigned char name_length;
+	unsigned char text_length;
+	unsigned short crc; // CRC-16 from seq to the end of the text
+	char data[];		// Sender name, then the text, neither terminated
 };
 
+// Received link frame
+struct Frame
+{
+	unsigned char type;
+	unsigned char length;
+	unsigned char seq;
+	char *payload; // Caller's buffer of FRAME_MAX_PAYLOAD + 1 bytes, null-terminated
+};
+
+#if PROFILE
+struct Histogram
+{
+	unsigned int count;
+	unsigned int max;
+	unsigned int buckets[HIST_BUCKETS]; // Bucket n counts values of n bits
+};
+#endif
+
+// Performance counters. The ISRs only do plain increments, and the fields
+// they touch share the first cache line; the per-second rates at the end are
+// worked out by update_load_stats() for the HUD.
+struct Stats
+{
+	// Written by the ISRs
+	unsigned int rx_bytes;
+	unsigned int rx_transfers;
+	unsigned int rx_dropped_bytes; // Bytes lost to a full receive ring
+	unsigned int rx_ack_stalls;	   // Times the acknowledge was held back for space
+	unsigned int tx_bytes_sent;
+	unsigned int tx_transfers;	  // Strobed link words, one or more bytes each
+	unsigned int tx_ack_timeouts; // Transfers the peer never acknowledged
+	unsigned int kb_dropped_codes; // Scan codes lost to a full keyboard ring
+	unsigned int isr_cycles;	   // Total cycles spent in interrupt_handler
+	unsigned int ps2_isr_max_cycles;
+
+	// Written by the main loop
+	unsigned int events_handled;
+	unsigned int idle_cycles; // Cycles the main loop spent waiting for events
+	unsigned int frames_drawn;
+	unsigned int last_frame_cycles;
+	unsigned int max_frame_cycles;
+	unsigned int last_frame_cells; // Character cells written by the last flush
+	unsigned int total_cells;
+	unsigned int rx_frames;
+	unsigned int rx_corrupt_frames; // Frames that failed the CRC
+	unsigned int rx_seq_gaps;		// Frames dropped for arriving ahead of a missing one
+	unsigned int rx_duplicates;		// Frames dropped for having arrived already
+	unsigned int tx_retransmits;	// Frames sent again for want of an ACK
+	unsigned int tx_dropped_frames; // Frames refused while all TX_SLOTS were taken
+	unsigned int tx_dropped_bytes; // Bytes lost to a full transmit queue
+	unsigned int tx_max_depth;
+	unsigned int tx_payload_bytes; // Frame payload bytes before packing
+	unsigned int tx_packed_bytes;  // Frame payload bytes actually sent
+	unsigned int messages_stored;
+	unsigned int messages_evicted;
+	unsigned int store_cycles; // Total cycles spent reserving and committing records
+	unsigned int log_restored;		 // Messages rebuilt from the chat log at startup
+	unsigned int log_skipped;		 // Log records passed over for a bad checksum
+	unsigned int log_restore_cycles;
+	unsigned int index_cycles;	// Total cycles spent adding postings
+	unsigned int search_cycles; // Last query
+	unsigned int link_connects;	 // Handshakes completed
+	unsigned int link_drops;	 // Links dropped for want of heartbeats
+	unsigned int link_rejected;	 // Hellos with another protocol version
+	unsigned int name_ticks;	 // From reset to the name being entered
+	unsigned int connect_ticks;	 // From reset to the first handshake
+	unsigned int ready_ticks;	 // From reset to the chat screen
+
+	// Over the last second
+	unsigned int events_per_second;
+	unsigned int idle_percent;
+	unsigned int isr_permille; // Share of cycles spent in interrupt_handler
+	unsigned int rx_bytes_per_second;
+	unsigned int tx_bytes_per_second;
+	unsigned int message_rate; // Messages stored per ten seconds
+} __attribute__((aligned(32)));
+
 /* PROGRAM GLOBAL VARIABLES */
 char buffer[BUFFER_SIZE];
 char my_user_name[BUFFER_SIZE];
-volatile char received_buffer[BUFFER_SIZE];
 volatile char connected_user_name[BUFFER_SIZE];
 
 char last_pressed = 0;
-char byte1 = 0;
-char byte2 = 0;
-char byte3 = 0;
+
+// PS/2 decoder state
+bool kb_break = false;	  // Last byte was the 0xF0 break prefix
+bool kb_extended = false; // Last byte was the 0xE0 extended prefix
+int kb_skip = 0;		  // Bytes left of a Pause sequence
+bool kb_left_shift = false;
+bool kb_right_shift = false;
+bool kb_caps_lock = false;
 
 int cursor_x = 0;
 int cursor_y = 0;
 int buffer_index = 0;
-int scrollCounter = 0;
-int messageCounter = 0;
+int edit_pos = 0; // Caret position within buffer
 
+// Connection state. conn and the ticks are read by tick_ISR to decide when
+// a hello or heartbeat is due; link_session is 0 until the name is entered.
 volatile int conn = 0;
-volatile int received_index = 0;
-volatile int received_index_saver = 0;
+volatile unsigned short link_session = 0; // Ours, new each time the link drops
+unsigned short peer_session = 0;
+volatile unsigned int hello_tick = 0;	  // tick_count at which the next hello is due
+volatile unsigned int link_heard_tick = 0; // tick_count at the last good frame in
+volatile unsigned int link_sent_tick = 0;  // tick_count at the last frame out
+
+// Receive ring between gpio_ISR and the main loop. The indices run freely and
+// are masked on access; rx_head is only written by the ISR and rx_tail only by
+// the main loop, so no locking is needed.
+volatile char rx_ring[RX_RING_SIZE];
+volatile unsigned int rx_head = 0;
+volatile unsigned int rx_tail = 0;
+volatile unsigned int rx_last_tick = 0; // tick_count at the last transfer in
+unsigned char rx_expected_seq = 0;
+
+// Reliable send queue by sequence number: tx_base is the oldest frame not yet
+// acknowledged, tx_next the next one to put on the link and tx_seq the next
+// free one. Only the main loop touches it; tick_ISR just watches the timeout.
+struct TxSlot tx_slots[TX_SLOTS];
+unsigned char tx_base = 0;
+unsigned char tx_next = 0;
+unsigned char tx_seq = 0;
+volatile unsigned int retransmit_tick = 0; // tick_count at which tx_base times out
+volatile bool retransmit_armed = false;
+unsigned int retransmit_ticks = RETRANSMIT_TICKS;
+int repeated_acks = 0; // ACKs in a row that did not move tx_base
+
+// Symbol for each character, PACK6_ESCAPE for characters outside the alphabet
+// and the lowercase symbol with PACK6_UPPER_FLAG for capitals
+unsigned char pack6_symbol[256];
+
+// CRC-16/CCITT (polynomial 0x1021) lookup table
+const unsigned short crc16_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+	0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+	0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+	0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+	0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+	0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+	0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+	0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+	0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+	0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+	0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+	0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+	0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+	0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+	0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+	0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+	0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+	0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+	0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+	0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+	0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+	0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+
+// Outgoing bytes, drained by timer_ISR one byte per tx_byte_period. The timer
+// registers are reached through tx_timer so a simulated timer can stand in.
+volatile char tx_ring[TX_RING_SIZE];
+volatile unsigned int tx_head = 0;
+volatile unsigned int tx_tail = 0;
+volatile bool tx_active = false;
+volatile int tx_ack_waits = 0; // Timeouts so far on the transfer on the link
+int link_ctrl_out = 0; // Current level of the strobe, acknowledge and lane-valid outputs
+volatile bool rx_ack_pending = false; // A transfer is waiting for ring space to be acknowledged
+volatile int *tx_timer = (int *)TIMER_BASE;
+unsigned int tx_byte_period = TX_BYTE_PERIOD;
+
+// Raw scan codes from ps2_ISR, decoded by the main loop
+volatile unsigned char kb_ring[KB_RING_SIZE];
+volatile unsigned int kb_head = 0;
+volatile unsigned int kb_tail = 0;
+
+#if PROFILE
+struct Histogram histograms[HIST_COUNT];
+const char *const histogram_names[HIST_COUNT] = {
+	"irq latency", "interrupt_handler", "ps2_ISR", "gpio_ISR",
+	"timer_ISR", "tick_ISR", "frame", "key to screen",
+};
+unsigned int kb_cycles[KB_RING_SIZE]; // When each scan code arrived
+unsigned int key_cycles = 0;		  // Arrival of the oldest key not yet drawn
+bool key_waiting = false;			  // A key is waiting for a frame
+volatile unsigned int key_swap_cycles = 0; // Arrival of the oldest key in the frame waiting for its swap
+volatile bool key_swap_waiting = false;
+
+// F2 dump text, drained to the JTAG UART as its FIFO has room. Characters
+// that do not fit are dropped.
+char profile_out[PROFILE_OUT_SIZE];
+volatile unsigned int profile_out_head = 0;
+volatile unsigned int profile_out_tail = 0;
+#endif
 
 bool cursor_toggle = 1;
 
-struct Message messages[4 * BUFFER_SIZE];
+// Events from the ISRs to the main loop. event_queued has a bit per type that
+// is in the ring; the main loop clears it with interrupts off.
+volatile unsigned char event_ring[EVENT_RING_SIZE];
+volatile unsigned int event_head = 0;
+volatile unsigned int event_tail = 0;
+volatile unsigned int event_queued = 0;
+
+// TIMER2 ticks since start, counted by tick_ISR
+volatile unsigned int tick_count = 0;
+unsigned int blink_ticks = 0; // Ticks since the last EVENT_BLINK, only used by tick_ISR
+unsigned int last_key_tick = 0;	  // The cursor stays on while typing
+unsigned int load_window_tick = 0; // Start of the window for the per-second stats
+unsigned int load_window_cycles = 0;
+struct Stats load_window; // The counters at the start of the window
+bool hud_visible = false;
+
+// Live typing: with stream_typing on, each edit of a message goes to the peer
+// as it is made and Enter only sends FRAME_TYPING_COMMIT. stream_state is 0
+// before the first edit of a line, 1 while the line is mirrored and 2 when it
+// is not, so Enter sends the whole line.
+bool stream_typing = false;
+int stream_state = 0;
+char peer_preview[FRAME_MAX_PAYLOAD + 1]; // The line the peer is typing
+int peer_preview_length = 0;
+
+// Message arena. Live records run from arena_head to arena_tail, and
+// message_offset finds the record for any live message id.
+char arena[ARENA_SIZE] __attribute__((aligned(RECORD_ALIGN)));
+unsigned int arena_head = 0;
+unsigned int arena_tail = 0;
+unsigned int arena_used = 0;
+unsigned int first_message_id = 0; // Oldest message still in the arena
+unsigned int next_message_id = 0;
+unsigned int message_offset[MESSAGE_INDEX_SIZE];
+
+unsigned int log_next_seq = 0; // Sequence number of the next chat log record
+
+// Trigram index over the message store. A chain link is only followed while
+// the slot it names still holds an older posting for a live message.
+struct Posting postings[POSTING_POOL_SIZE];
+unsigned int posting_head = 0;					// Postings ever added
+unsigned int posting_start[MESSAGE_INDEX_SIZE]; // posting_head when each live message was indexed
+unsigned int trigram_newest[TRIGRAM_BUCKETS];
+
+// Search mode, opened with F4. Messages in the results have search_match set
+// to the current search_generation.
+bool search_active = false;
+char search_query[SEARCH_MAX_LENGTH + 1];
+int search_length = 0;
+unsigned int search_results[SEARCH_MAX_RESULTS]; // Message ids, newest first
+int search_count = 0;
+int search_shown = -1; // Result Enter last scrolled to
+unsigned int search_generation = 1;
+unsigned int search_match[MESSAGE_INDEX_SIZE];
+
+// Scrollback index: first virtual row of each live message
+unsigned int message_row[MESSAGE_INDEX_SIZE];
+unsigned int total_rows = 0;
+unsigned int scroll_offset = 0; // Rows between the bottom of the view and the newest row
+
+// Interned sender names, referenced from records by index
+char sender_names[MAX_SENDERS][SENDER_NAME_SIZE];
+unsigned char sender_shown[MAX_SENDERS]; // Columns the name takes on screen
+unsigned int sender_refs[MAX_SENDERS];	 // Live records that use the name
+int sender_count = 0;
+const short int sender_colours[MAX_SENDERS] = {0x07FF, 0xFFE0, 0xF81F, 0x07E0, 0xFD20, 0x867F, 0xF9E7, 0xAFE5};
+
+// Glyphs for ' ' to '~', one bit per pixel, rows top to bottom from bit 14.
+// Lowercase letters use the capitals.
+const unsigned short font3x5[95] = {
+	0x0000, 0x2482, 0x5A00, 0x5F7D, 0x3C9E, 0x42A1, 0x2AAB, 0x2400,
+	0x1491, 0x4494, 0x0AA8, 0x05D0, 0x0014, 0x01C0, 0x0002, 0x12A4,
+	0x7B6F, 0x2C97, 0x62A7, 0x628E, 0x5BC9, 0x798E, 0x39EF, 0x7292,
+	0x7BEF, 0x7BCE, 0x0410, 0x0414, 0x1511, 0x0E38, 0x4454, 0x6282,
+	0x7BE3, 0x2BED, 0x6BAE, 0x3923, 0x6B6E, 0x79A7, 0x79A4, 0x396B,
+	0x5BED, 0x7497, 0x126A, 0x5BAD, 0x4927, 0x5FED, 0x6B6D, 0x2B6A,
+	0x6BA4, 0x2B7B, 0x6BAD, 0x388E, 0x7492, 0x5B6F, 0x5B52, 0x5BFD,
+	0x5AAD, 0x5A92, 0x72A7, 0x6926, 0x4889, 0x324B, 0x2A00, 0x0007,
+	0x4400, 0x2BED, 0x6BAE, 0x3923, 0x6B6E, 0x79A7, 0x79A4, 0x396B,
+	0x5BED, 0x7497, 0x126A, 0x5BAD, 0x4927, 0x5FED, 0x6B6D, 0x2B6A,
+	0x6BA4, 0x2B7B, 0x6BAD, 0x388E, 0x7492, 0x5B6F, 0x5B52, 0x5BFD,
+	0x5AAD, 0x5A92, 0x72A7, 0x3513, 0x2492, 0x6456, 0x0780,
+};
+
+// Rasterized glyphs: each row is GLYPH_WIDTH pixels in two words, ready to
+// store. Direct-mapped on the character and its colours.
+unsigned int glyph_cache[GLYPH_CACHE_SIZE][GLYPH_HEIGHT][GLYPH_WIDTH / 2];
+unsigned char glyph_char[GLYPH_CACHE_SIZE]; // 0 for an empty slot
+unsigned short glyph_fg[GLYPH_CACHE_SIZE];
+unsigned short glyph_bg[GLYPH_CACHE_SIZE];
+
+// Frame buffer start addresses, read once from the buffer controllers so they
+// can also be pointed at a plain memory block
+volatile short int *pixel_buffer_start;
+volatile char *character_buffer_start;
+
+// Pixel DMA controller registers, kept behind a pointer so the swap logic can
+// run against a simulated controller
+volatile int *pixel_ctrl = (int *)PIXEL_BUFFER_BASE;
+
+// Front and back pixel buffers
+short int Buffer1[SCREEN_HEIGHT][512];
+short int Buffer2[SCREEN_HEIGHT][512];
+
+// Shadow of the character buffer. Text is written here and flush_characters()
+// copies only what differs from char_screen, the copy of what is on screen.
+// Rows are kept as words so a flush can store four cells at a time.
+unsigned int char_shadow[CHAR_ROWS][CHAR_COLUMNS / 4];
+unsigned int char_screen[CHAR_ROWS][CHAR_COLUMNS / 4];
+bool char_row_dirty[CHAR_ROWS];
+
+volatile int dirty_regions = REGION_ALL; // Read by tick_ISR
+int prev_frame_regions = REGION_ALL; // Regions the back buffer is missing
+
+struct Stats stats;
+char *log_area; // LOG_HOME, or LOG_SCRATCH while benchmark_log runs
 
 /* INTERRUPT FUNCTION PROTOTYPES */
 void the_reset(void) __attribute__((section(".reset")));
@@ -71,34 +703,148 @@ void the_exception(void) __attribute__((section(".exceptions")));
 /* FUNCTION PROTOTYPES */
 void plot_pixel(int, int, short int);
 void clear_screen();
+void fill_span(int, int, int, short int);
+void fill_rect(int, int, int, int, short int);
+void draw_hline(int, int, int, short int);
+void draw_vline(int, int, int, short int);
 void swap(int *, int *);
 void draw_line(int, int, int, int, short int);
-void draw_cursor_colour();
 void draw_cursor(int x, int y);
 void draw_typing_border();
 void draw_logged_in_border();
 void write_char(int, int, char);
 void clear_characters();
 void write_word(int, int, char *);
+void write_span(int, int, const char *, int);
+const unsigned int *glyph_rows(char c, short int fg, short int bg);
+void draw_glyph(int x, int y, char c, short int fg, short int bg);
+void draw_glyph_pixels(int x, int y, char c, short int fg, short int bg);
+void draw_text(int column, int y, const char *text, int length, short int fg, short int bg);
+void benchmark_glyphs();
+void flush_characters();
+void init_frame_buffers();
+volatile short int *pixel_dma_back_buffer();
+bool pixel_dma_swap_pending();
+void pixel_dma_request_swap();
+void wait_for_vsync();
+void init_cycle_counter();
+unsigned int read_cycles();
+void clear_pixel_rows(int, int);
+void clear_character_rows(int, int);
+void mark_dirty(int);
+void redraw_dirty();
 void initial_setup();
-void enter_delete_pressed();
 void clean_display();
 void enter_name();
 void whos_logged_in();
-void test_messages(struct MessageNode *head);
+void test_messages();
+void benchmark_primitives();
+void benchmark_packing();
+bool test_framer(void);
+bool test_keyboard(void);
+bool test_ring(void);
 void detect_connection();
-void insertMessage(struct MessageNode **head, struct Message m);
-void printMessages(struct MessageNode *head);
-void show_message(struct MessageNode *m, int counter);
+int intern_sender(const char *name);
+struct MessageRecord *get_message(unsigned int id);
+void evict_oldest_message();
+char *message_reserve();
+void message_commit(int sender, int length);
+struct MessageLine *message_lines(struct MessageRecord *m);
+int layout_message(struct MessageRecord *m);
+void insertMessage(const char *sender, const char *text, int length);
+void log_reset(void);
+unsigned short log_record_crc(struct LogRecord *record);
+void log_append(struct MessageRecord *m);
+int log_restore(void);
+void benchmark_log(void);
+void init_search_index(void);
+char fold_case(char c);
+int trigram_hash(const char *text);
+void index_message(struct MessageRecord *m);
+int posting_follow(unsigned int index, int trigram, unsigned int newer_id);
+bool message_contains(struct MessageRecord *m, const char *query, int length);
+int search_messages(const char *query, int length, unsigned int *results, int max);
+void run_search(void);
+void search_key(int key);
+void scroll_to_message(unsigned int id);
+void draw_input_line(void);
+void draw_search_line(void);
+void benchmark_search(void);
+void benchmark_message_store();
+unsigned int find_message_at_row(unsigned int row);
+void scroll_messages(int rows);
+void printMessages();
+void show_message_line(struct MessageRecord *m, int line, int row);
+void benchmark_render();
+void benchmark_scroll();
 void interrupt_handler(void);
+void profile_record(int hist, unsigned int cycles);
+void profile_write(const char *text);
+void profile_drain(void);
+void profile_dump(void);
+void tick_ISR(void);
+void post_event(int type);
+int wait_for_event(void);
+void handle_key_event(void);
+void handle_rx_event(void);
+void handle_blink_event(void);
+void update_load_stats(void);
+void draw_hud(void);
 void gpio_ISR(void);
 void ps2_ISR(void);
+void process_keyboard(void);
+void process_next_key(void);
+void handle_scan_code(char scanCode);
 void send_data_to_gpio(void);
-char scanCodeDecoder(char scanCode);
-char get_gpio_data(volatile int *GPIO_PTR);
-struct MessageNode *createMessage(struct Message m);
+void stream_edit(unsigned char type, int position, char c);
+void preview_edit(struct Frame *frame);
+void draw_preview(void);
+void tx_enqueue(char);
+void tx_start(void);
+void tx_send_word(void);
+void tx_timer_start(unsigned int period, int control);
+void tx_acknowledged(void);
+void rx_acknowledge(void);
+void rx_release(void);
+unsigned int tx_queue_depth(void);
+void timer_ISR(void);
+unsigned short crc16_update(unsigned short crc, unsigned char data);
+void init_pack6();
+int pack6_encode(const char *src, int length, char *dest, int size);
+int pack6_decode(const char *src, int length, char *dest, int size);
+bool send_frame(unsigned char type, const char *payload, int length);
+void frame_enqueue(unsigned char type, unsigned char seq, const char *payload, int length);
+void tx_fill_window(void);
+void tx_arm_retransmit(void);
+void tx_acknowledged_to(unsigned char ack);
+void handle_retransmit_event(void);
+void tx_go_back(void);
+void link_start(void);
+void link_up(struct Frame *frame, unsigned short session);
+void link_down(void);
+void link_hello(struct Frame *frame);
+void send_hello(unsigned char type, unsigned short known);
+void handle_link_event(void);
+bool benchmark_link(int count, int size);
+void init_devices(void);
+bool rx_pop_frame(struct Frame *frame);
+int decode_scan_code(unsigned char scanCode);
+void edit_buffer(int key);
+int get_gpio_data(volatile int *GPIO_PTR);
+void rx_push(char);
 
 /* INTERRUPT HANDLERS */
+#ifdef HOST_BUILD
+// The status bit masks the simulator's interrupt signal
+#define NIOS2_READ_STATUS(dest) ((dest) = sim_status)
+#define NIOS2_WRITE_STATUS(src) sim_write_status(src)
+#define NIOS2_READ_ESTATUS(dest) ((dest) = 0)
+#define NIOS2_READ_BSTATUS(dest) ((dest) = 0)
+#define NIOS2_READ_IENABLE(dest) ((dest) = sim_ienable)
+#define NIOS2_WRITE_IENABLE(src) sim_write_ienable(src)
+#define NIOS2_READ_IPENDING(dest) ((dest) = sim_read_ipending())
+#define NIOS2_READ_CPUID(dest) ((dest) = 0)
+#else
 #define NIOS2_READ_STATUS(dest)    \
 	do                             \
 	{                              \
@@ -146,8 +892,10 @@ struct MessageNode *createMessage(struct Message m);
 	{                              \
 		dest = __builtin_rdctl(5); \
 	} while (0)
+#endif
 
 /* INTERRUPT FUNCTION DECLARATIONS */
+#ifndef HOST_BUILD
 void the_reset(void)
 /*******************************************************************************
  * Reset code. By giving the code a section attribute with the name ".reset" we
@@ -253,822 +1001,4564 @@ void the_exception(void)
 
 	asm("eret");
 }
+#endif
 
 /* FUNCTION DEFINITIONS */
-char scanCodeDecoder(char scanCode)
+/* PS/2 SET 2 KEY TABLES */
+// Unshifted keys
+const unsigned char keymap[256] = {
+	[0x0E] = '`', [0x16] = '1', [0x1E] = '2', [0x26] = '3', [0x25] = '4', [0x2E] = '5',
+	[0x36] = '6', [0x3D] = '7', [0x3E] = '8', [0x46] = '9', [0x45] = '0', [0x4E] = '-',
+	[0x55] = '=', [0x66] = KEY_BACKSPACE,
+	[0x15] = 'q', [0x1D] = 'w', [0x24] = 'e', [0x2D] = 'r', [0x2C] = 't', [0x35] = 'y',
+	[0x3C] = 'u', [0x43] = 'i', [0x44] = 'o', [0x4D] = 'p', [0x54] = '[', [0x5B] = ']',
+	[0x5D] = '\\',
+	[0x1C] = 'a', [0x1B] = 's', [0x23] = 'd', [0x2B] = 'f', [0x34] = 'g', [0x33] = 'h',
+	[0x3B] = 'j', [0x42] = 'k', [0x4B] = 'l', [0x4C] = ';', [0x52] = '\'', [0x5A] = KEY_ENTER,
+	[0x1A] = 'z', [0x22] = 'x', [0x21] = 'c', [0x2A] = 'v', [0x32] = 'b', [0x31] = 'n',
+	[0x3A] = 'm', [0x41] = ',', [0x49] = '.', [0x4A] = '/',
+	[0x29] = ' ', [0x76] = KEY_ESC,
+	// Keypad
+	[0x7C] = '*', [0x7B] = '-', [0x79] = '+', [0x71] = '.', [0x70] = '0', [0x69] = '1',
+	[0x72] = '2', [0x7A] = '3', [0x6B] = '4', [0x73] = '5', [0x74] = '6', [0x6C] = '7',
+	[0x75] = '8', [0x7D] = '9',
+	// Function keys
+	[0x05] = KEY_F1, [0x06] = KEY_F1 + 1, [0x04] = KEY_F1 + 2, [0x0C] = KEY_F1 + 3,
+	[0x03] = KEY_F1 + 4, [0x0B] = KEY_F1 + 5, [0x83] = KEY_F1 + 6, [0x0A] = KEY_F1 + 7,
+	[0x01] = KEY_F1 + 8, [0x09] = KEY_F1 + 9, [0x78] = KEY_F1 + 10, [0x07] = KEY_F12,
+};
+
+// Keys that change with shift; letters use caps lock as well
+const unsigned char keymap_shift[256] = {
+	[0x0E] = '~', [0x16] = '!', [0x1E] = '@', [0x26] = '#', [0x25] = '$', [0x2E] = '%',
+	[0x36] = '^', [0x3D] = '&', [0x3E] = '*', [0x46] = '(', [0x45] = ')', [0x4E] = '_',
+	[0x55] = '+', [0x54] = '{', [0x5B] = '}', [0x5D] = '|', [0x4C] = ':', [0x52] = '"',
+	[0x41] = '<', [0x49] = '>', [0x4A] = '?',
+};
+
+// Keys behind the 0xE0 prefix
+const unsigned char keymap_extended[256] = {
+	[0x75] = KEY_UP, [0x72] = KEY_DOWN, [0x6B] = KEY_LEFT, [0x74] = KEY_RIGHT,
+	[0x6C] = KEY_HOME, [0x69] = KEY_END, [0x71] = KEY_DELETE, [0x70] = KEY_INSERT,
+	[0x7D] = KEY_PAGE_UP, [0x7A] = KEY_PAGE_DOWN, [0x5A] = KEY_ENTER, [0x4A] = '/',
+};
+
+int decode_scan_code(unsigned char scanCode)
 {
-	// Getting the scan code and returning the ASCII value
+	// Returns the key for a make code, or 0 for prefixes, breaks and modifiers
+	if (kb_skip > 0)
+	{
+		kb_skip--;
+		return 0;
+	}
+	if (scanCode == 0xE0)
+	{
+		kb_extended = true;
+		return 0;
+	}
+	if (scanCode == 0xF0)
+	{
+		kb_break = true;
+		return 0;
+	}
+	if (scanCode == 0xE1)
+	{
+		kb_skip = 7; // Pause sends E1 14 77 E1 F0 14 F0 77 and has no break
+		return 0;
+	}
+
+	bool is_break = kb_break;
+	bool is_extended = kb_extended;
+	kb_break = false;
+	kb_extended = false;
+
+	if (is_extended)
+	{
+		// 0xE0 0x12 and 0xE0 0x59 are fake shifts around Print Screen
+		return is_break ? 0 : keymap_extended[scanCode];
+	}
+
 	switch (scanCode)
 	{
-	case 0x76: // ESC
-		return 0X1B;
-		break;
-	case 0X1C: // A
-		return 0X41;
-		break;
-	case 0x32: // B
-		return 0X42;
-		break;
-	case 0x21: // C
-		return 0X43;
-		break;
-	case 0x23: // D
-		return 0X44;
-		break;
-	case 0x24: // E
-		return 0X45;
-		break;
-	case 0x2B: // F
-		return 0X46;
-		break;
-	case 0x34: // G
-		return 0X47;
-		break;
-	case 0x33: // H
-		return 0X48;
-		break;
-	case 0x43: // I
-		return 0X49;
-		break;
-	case 0x3B: // J
-		return 0X4A;
-		break;
-	case 0x42: // K
-		return 0X4B;
-		break;
-	case 0x4B: // L
-		return 0X4C;
-		break;
-	case 0x3A: // M
-		return 0X4D;
-		break;
-	case 0x31: // N
-		return 0X4E;
-		break;
-	case 0x44: // O
-		return 0X4F;
-		break;
-	case 0x4D: // P
-		return 0X50;
-		break;
-	case 0x15: // Q
-		return 0X51;
-		break;
-	case 0x2D: // R
-		return 0X52;
-		break;
-	case 0x1B: // S
-		return 0X53;
-		break;
-	case 0x2C: // T
-		return 0X54;
-		break;
-	case 0x3C: // U
-		return 0X55;
-		break;
-	case 0x2A: // V
-		return 0X56;
-		break;
-	case 0x1D: // W
-		return 0X57;
-		break;
-	case 0x22: // X
-		return 0X58;
-		break;
-	case 0x35: // Y
-		return 0X59;
-		break;
-	case 0x1A: // Z
-		return 0X5A;
-		break;
-	case 0x45: // 0
-		return 0X30;
-		break;
-	case 0x16: // 1
-		return 0X31;
-		break;
-	case 0x1E: // 2
-		return 0X32;
-		break;
-	case 0x26: // 3
-		return 0X33;
-		break;
-	case 0x25: // 4
-		return 0X34;
-		break;
-	case 0x2E: // 5
-		return 0X35;
-		break;
-	case 0x36: // 6
-		return 0X36;
-		break;
-	case 0x3D: // 7
-		return 0X37;
-		break;
-	case 0x3E: // 8
-		return 0X38;
-		break;
-	case 0x46: // 9
-		return 0X39;
-		break;
-	case 0x66:
-		return 0x08; // Backspace
-		break;
-	case 0x49: // Period
-		return 0x2E;
-		break;
-	case 0x52: // Apostrophe
-		return 0x27;
-		break;
-	case 0x41: // Comma
-		return 0x2C;
-		break;
-	case 0x0E: // Backtick
-		return 0x60;
-		break;
-	case 0x4E: // Minus
-		return 0x2D;
-		break;
-	case 0x55: // Equals
-		return 0x3D;
-		break;
-	case 0x54: // Left Bracket
-		return 0x5B;
-		break;
-	case 0x5B: // Right Bracket
-		return 0x5D;
-		break;
-	case 0x4C: // Semicolon
-		return 0x3B;
-		break;
-	case 0x4A: // Slash
-		return 0x2F;
-		break;
-	case 0x7C: // Star
-		return 0x2A;
-		break;
-	case 0x5D: // Front Slash
-		return 0x5C;
-		break;
-	case 0x79: // Plus
-		return 0x2B;
-		break;
-	case 0x29: // Space
-		return 0x20;
-		break;
-	case 0x5A: // Enter
-		return 0x10;
-		break;
-	case 0xF0: // Break code
-		break;
-	default:
-		break;
+	case 0x12: // Left shift
+		kb_left_shift = !is_break;
+		return 0;
+	case 0x59: // Right shift
+		kb_right_shift = !is_break;
+		return 0;
+	case 0x58: // Caps lock
+		if (!is_break)
+		{
+			kb_caps_lock = !kb_caps_lock;
+		}
+		return 0;
+	}
+
+	if (is_break)
+	{
+		return 0;
+	}
+
+	int key = keymap[scanCode];
+	bool shift = kb_left_shift || kb_right_shift;
+	if (key >= 'a' && key <= 'z')
+	{
+		if (shift != kb_caps_lock)
+		{
+			key -= 'a' - 'A';
+		}
+	}
+	else if (shift && keymap_shift[scanCode])
+	{
+		key = keymap_shift[scanCode];
 	}
+	return key;
 }
 
-char get_gpio_data(volatile int *GPIO_PTR)
+int get_gpio_data(volatile int *GPIO_PTR)
 {
-	char data = *GPIO_PTR >> 8;
-	return data & 0xFF;
+	// Move the input lanes down onto the output lane positions
+	return (IO_READ(GPIO_PTR) >> 8) & LINK_DATA_OUT_MASK;
 }
 
 void send_data_to_gpio(void)
 {
-	for (int i = 0; i < buffer_index; i++)
+	// The line is sent, shown and logged as its Enter is handled, so keys
+	// after it in the same batch already start the next line
+	if (buffer_index == 0)
 	{
-		*GPIO_PTR = buffer[i];
-		for (int j = 0; j < 270; j++)
-		{
-		}
+		return;
 	}
 
-	buffer_index = 0; // Reset buffer index after sending
+	// A mirrored line is already on the other board. With the send queue
+	// full, the line stays in the input box for another Enter.
+	bool queued = stream_state == 1 ? send_frame(FRAME_TYPING_COMMIT, buffer, 0)
+									: send_frame(FRAME_MESSAGE, buffer, buffer_index);
+	if (!queued)
+	{
+		return;
+	}
+	insertMessage(my_user_name, buffer, buffer_index);
+	log_append(get_message(next_message_id - 1));
+
+	memset(buffer, 0, BUFFER_SIZE);
+	buffer_index = 0;
+	edit_pos = 0;
+	stream_state = 0;
+	mark_dirty(REGION_MESSAGES | REGION_INPUT);
 }
 
-void gpio_ISR(void)
+void stream_edit(unsigned char type, int position, char c)
 {
-	char data;
-	data = get_gpio_data(GPIO_PTR);
-	received_buffer[received_index] = data;
-	received_index++;
-
-	if (received_index >= BUFFER_SIZE)
+	// The first edit decides whether the line is mirrored
+	if (stream_state == 0)
+	{
+		stream_state = stream_typing && my_user_name[0] != 0 ? 1 : 2;
+	}
+	if (stream_state != 1)
 	{
-		received_index_saver = received_index;
-		received_index = 0; // Reset buffer index to avoid overflow
-		*(volatile int *)(GPIO_BASE + 0x0C) = 0xFFFFFFFF;
+		return;
 	}
-	else if (received_buffer[received_index - 1] == 0x10)
+	if ((unsigned char)(tx_seq - tx_base) == TX_SLOTS)
 	{
-		received_index_saver = received_index;
-		received_index = 0; // Reset buffer index to avoid overflow
-		*(volatile int *)(GPIO_BASE + 0x0C) = 0xFFFFFFFF;
+		// An edit would be lost, so Enter sends the line in full instead
+		stream_state = 2;
+		return;
 	}
+
+	char payload[2] = {position, c};
+	send_frame(type, payload, type == FRAME_TYPING_INSERT ? 2 : 1);
 }
 
-void ps2_ISR(void)
+void tx_enqueue(char data)
 {
-	// PS2 interrupt service routine
-	int PS2_data, RVALID;
-	PS2_data = *(PS2_PTR);
-	RVALID = (PS2_data & 0x8000);
-
-	if (RVALID)
+	if (tx_head - tx_tail == TX_RING_SIZE)
 	{
-		byte1 = byte2;
-		byte2 = byte3;
-		byte3 = PS2_data & 0xFF;
-		char key = byte1;
-		if (key != 0)
-		{ // Not a break code
-			byte1 = 0, byte2 = 0, byte3 = 0;
-			key = scanCodeDecoder(key);
-
-			last_pressed = key;
-
-			if (key == 0x08)
-			{ // Backspace key pressed
-				if (buffer_index > 0)
-				{
-					buffer_index--;
-					buffer[buffer_index] = 0;
-				}
-			}
-			else
-			{
-				buffer[buffer_index] = key;
-				buffer_index++;
-			}
-
-			if (buffer_index >= BUFFER_SIZE)
-			{
-				buffer_index = 0; // Reset buffer index to avoid overflow
-			}
+		stats.tx_dropped_bytes++;
+		return;
+	}
+	tx_ring[tx_head & TX_RING_MASK] = data;
+	tx_head++;
 
-			if (key == 0x10)
-			{ // Enter key pressed
-				send_data_to_gpio();
-			}
-		}
+	unsigned int depth = tx_queue_depth();
+	if (depth > stats.tx_max_depth)
+	{
+		stats.tx_max_depth = depth;
 	}
 }
 
-void interrupt_handler(void)
+void tx_start(void)
 {
-	int ipending;
-	NIOS2_READ_IPENDING(ipending);
-	if (ipending & (1 << PS2_IRQ))
-	{ // Check if PS2 interrupt
-		ps2_ISR();
+#if LINK_HANDSHAKE
+	// Only send directly when no transfer is waiting for its acknowledge
+	NIOS2_WRITE_STATUS(0);
+	if (!tx_active && tx_queue_depth() > 0)
+	{
+		tx_active = true;
+		tx_send_word();
 	}
-	if (ipending & (1 << GPIO_IRQ))
-	{ // Check if GPIO interrupt
-		gpio_ISR();
-		conn = 1;
+	NIOS2_WRITE_STATUS(1);
+#else
+	// Bytes are queued before tx_active is checked, so a timer_ISR that has
+	// just stopped the timer cannot strand them
+	if (tx_active || tx_queue_depth() == 0)
+	{
+		return;
 	}
-	// Handle other interrupts as needed
+	tx_active = true;
+	tx_timer_start(tx_byte_period, 0x7); // Interrupt, continuous, start
+#endif
 }
 
-void plot_pixel(int x, int y, short int pixel_color)
+void tx_timer_start(unsigned int period, int control)
 {
-	volatile short int *one_pixel_address;
+	IO_WRITE(tx_timer + 1, 0x8); // Stop
+	IO_WRITE(tx_timer, 0);		 // Clear a timeout that has not been handled yet
+	IO_WRITE(tx_timer + 2, period & 0xFFFF);
+	IO_WRITE(tx_timer + 3, period >> 16);
+	IO_WRITE(tx_timer + 1, control);
+}
 
-	// set the address of the pixel to the buffer start plus its x and y coordinate
-	one_pixel_address = *PIXEL_PTR + (y << 10) + (x << 1);
+void tx_send_word(void)
+{
+	// Pack up to LINK_LANES bytes, first byte in the low lane
+	int word = (unsigned char)tx_ring[tx_tail & TX_RING_MASK];
+	tx_tail++;
+	link_ctrl_out &= ~LINK_WIDE_OUT;
+#if LINK_LANES == 2
+	if (tx_tail != tx_head)
+	{
+		word |= (unsigned char)tx_ring[tx_tail & TX_RING_MASK] << 16;
+		tx_tail++;
+		link_ctrl_out |= LINK_WIDE_OUT;
+	}
+#endif
 
-	// dereferencing the pixel address allows us to modify the pixel colour
-	*one_pixel_address = pixel_color;
+	// Data must be stable before the strobe edge
+	IO_WRITE(GPIO_PTR, word);
+	link_ctrl_out ^= LINK_STROBE_OUT;
+	IO_WRITE(GPIO_CTRL_PTR, link_ctrl_out);
+
+	stats.tx_bytes_sent += (link_ctrl_out & LINK_WIDE_OUT) ? 2 : 1;
+	stats.tx_transfers++;
+
+#if LINK_HANDSHAKE
+	// Don't wait forever on a peer that is not there
+	tx_ack_waits = 0;
+	tx_timer_start(LINK_ACK_TIMEOUT, 0x5); // Interrupt, one-shot, start
+#endif
 }
 
-void clear_screen()
+void tx_acknowledged(void)
+{
+	// The peer took the last transfer, send the next one straight away
+	if (tx_tail == tx_head)
+	{
+		IO_WRITE(tx_timer + 1, 0x8); // Stop the acknowledge timeout
+		IO_WRITE(tx_timer, 0);
+		tx_active = false;
+		return;
+	}
+	tx_send_word();
+}
+
+void rx_acknowledge(void)
 {
-	for (int x = 0; x < 320; x++)
+	// Only acknowledge once the ring can take another full transfer
+	if (RX_RING_SIZE - (rx_head - rx_tail) < LINK_LANES)
 	{
-		for (int y = 0; y < 240; y++)
+		if (!rx_ack_pending)
 		{
-			plot_pixel(x, y, 0x0000);
+			stats.rx_ack_stalls++;
 		}
+		rx_ack_pending = true;
+		return;
 	}
+	rx_ack_pending = false;
+	link_ctrl_out ^= LINK_ACK_OUT;
+	IO_WRITE(GPIO_CTRL_PTR, link_ctrl_out);
 }
 
-void swap(int *x, int *y)
+void rx_release(void)
 {
-	int temp = *x;
-	*x = *y;
-	*y = temp;
+	// Called after the main loop frees ring space
+	if (rx_ack_pending)
+	{
+		NIOS2_WRITE_STATUS(0);
+		rx_acknowledge();
+		if (!rx_ack_pending)
+		{
+			rx_last_tick = tick_count; // The link was only quiet because it was held
+		}
+		NIOS2_WRITE_STATUS(1);
+	}
 }
 
-// Using Bresenham's Algorithm to draw lines
-void draw_line(int x0, int y0, int x1, int y1, short int line_color)
+unsigned int tx_queue_depth(void)
 {
-	bool is_steep = abs(y1 - y0) > abs(x1 - x0);
+	return tx_head - tx_tail;
+}
 
-	if (is_steep)
+void timer_ISR(void)
+{
+	if (!(IO_READ(tx_timer) & 0x1))
 	{
-		swap(&x0, &y0);
-		swap(&x1, &y1);
+		return; // Already cleared by a restart
 	}
+	IO_WRITE(tx_timer, 0); // Clear the timeout bit
 
-	if (x0 > x1)
+#if LINK_HANDSHAKE
+	// No acknowledge arrived in time. A connected peer is most likely
+	// holding it back until its ring has room, so wait a while longer.
+	// After that, carry on as if it had come; heartbeats decide whether the
+	// peer is still there.
+	if (conn && tx_ack_waits < LINK_ACK_WAITS)
 	{
-		swap(&x0, &x1);
-		swap(&y0, &y1);
+		tx_ack_waits++;
+		tx_timer_start(LINK_ACK_TIMEOUT, 0x5);
+		return;
+	}
+	stats.tx_ack_timeouts++;
+	tx_acknowledged();
+#else
+	if (tx_tail == tx_head)
+	{
+		IO_WRITE(tx_timer + 1, 0x8); // Stop until more bytes are queued
+		tx_active = false;
+		return;
 	}
 
-	int deltaX = x1 - x0;
-	int deltaY = abs(y1 - y0);
-	int error = -1 * (deltaX / 2);
-	int y = y0;
-	int y_step = 0;
+	tx_send_word();
+#endif
+}
 
-	if (y0 < y1)
-	{
-		y_step = 1;
-	}
-	else
-	{
-		y_step = -1;
-	}
+void gpio_ISR(void)
+{
+	int edges = IO_READ(GPIO_CTRL_PTR + 3);
+	IO_WRITE(GPIO_CTRL_PTR + 3, 0xFFFFFFFF); // Clear edge capture
 
-	for (int x = x0; x <= x1; x++)
+	if (edges & LINK_STROBE_IN)
 	{
-		if (is_steep)
-		{
-			plot_pixel(y, x, line_color);
-		}
-		else
-		{
-			plot_pixel(x, y, line_color);
-		}
+		// A strobe edge means a new word is on the data lines
+		int data = get_gpio_data(GPIO_PTR);
+		int ctrl = IO_READ(GPIO_CTRL_PTR);
 
-		error = error + deltaY;
-
-		if (error > 0)
+		rx_push(data & 0xFF);
+		if (ctrl & LINK_WIDE_IN)
 		{
-			y = y + y_step;
-			error = error - deltaX;
+			rx_push((data >> 16) & 0xFF);
 		}
+		stats.rx_transfers++;
+		rx_last_tick = tick_count;
+		post_event(EVENT_RX);
+#if LINK_HANDSHAKE
+		rx_acknowledge();
+#endif
 	}
+
+#if LINK_HANDSHAKE
+	if (edges & LINK_ACK_IN)
+	{
+		tx_acknowledged();
+	}
+#endif
 }
 
-void draw_cursor_colour()
+void rx_push(char data)
 {
-	int cursor_colour;
-
-	if (cursor_toggle == 0)
+	if (rx_head - rx_tail == RX_RING_SIZE)
 	{
-		cursor_colour = 0x000;
+		stats.rx_dropped_bytes++;
 	}
 	else
 	{
-		cursor_colour = 0xFFFF;
+		rx_ring[rx_head & RX_RING_MASK] = data;
+		rx_head++; // Publish the byte only after it is stored
+		stats.rx_bytes++;
 	}
-
-	draw_line(cursor_x, cursor_y, cursor_x, cursor_y + 10, cursor_colour);
-	draw_line(cursor_x + 1, cursor_y, cursor_x + 1, cursor_y + 10, cursor_colour);
-	draw_line(cursor_x + 2, cursor_y, cursor_x + 2, cursor_y + 10, cursor_colour);
-	draw_line(cursor_x + 3, cursor_y, cursor_x + 3, cursor_y + 10, cursor_colour);
 }
 
-void draw_cursor(int x, int y)
+unsigned short crc16_update(unsigned short crc, unsigned char data)
 {
-	int cursor_colour;
+	return (crc << 8) ^ crc16_table[((crc >> 8) ^ data) & 0xFF];
+}
 
-	if (cursor_toggle == 0)
+void init_pack6()
+{
+	memset(pack6_symbol, PACK6_ESCAPE, sizeof(pack6_symbol));
+	const char *alphabet = PACK6_ALPHABET;
+	for (int i = 0; alphabet[i]; i++)
 	{
-		cursor_colour = 0x000;
+		pack6_symbol[(unsigned char)alphabet[i]] = i;
 	}
-	else
+	for (int c = 'A'; c <= 'Z'; c++)
 	{
-		cursor_colour = 0xFFFF;
+		pack6_symbol[c] = pack6_symbol[c - 'A' + 'a'] | PACK6_UPPER_FLAG;
 	}
-
-	draw_line(x, y, x, y + 10, cursor_colour);
-	draw_line(x + 1, y, x + 1, y + 10, cursor_colour);
-	draw_line(x + 2, y, x + 2, y + 10, cursor_colour);
-	draw_line(x + 3, y, x + 3, y + 10, cursor_colour);
 }
 
-void draw_typing_border()
+int pack6_encode(const char *src, int length, char *dest, int size)
 {
-	draw_line(0, 216, 319, 216, 0xFFFF);
-	draw_line(0, 217, 319, 217, 0xFFFF);
-}
+	// Returns the packed length, or -1 if it does not fit in size
+	unsigned int bits = 0;
+	int bit_count = 0;
+	int out = 0;
 
-void draw_logged_in_border()
-{
-	draw_line(0, 20, 319, 20, 0xFFFF);
-	draw_line(0, 21, 319, 21, 0xFFFF);
-}
+	for (int i = 0; i < length; i++)
+	{
+		unsigned char symbol = pack6_symbol[(unsigned char)src[i]];
+		if (symbol & PACK6_UPPER_FLAG)
+		{
+			bits = (bits << 6) | PACK6_UPPER;
+			bit_count += 6;
+			symbol &= ~PACK6_UPPER_FLAG;
+		}
+		bits = (bits << 6) | symbol;
+		bit_count += 6;
+		if (symbol == PACK6_ESCAPE)
+		{
+			bits = (bits << 8) | (unsigned char)src[i];
+			bit_count += 8;
+		}
 
-void write_char(int x, int y, char c)
-{
-	if (c == 0x10 || c == 0x08)
+		while (bit_count >= 8)
+		{
+			if (out == size)
+			{
+				return -1;
+			}
+			bit_count -= 8;
+			dest[out++] = bits >> bit_count;
+		}
+	}
+
+	if (bit_count > 0)
 	{
-		return;
+		if (out == size)
+		{
+			return -1;
+		}
+		dest[out++] = (bits << (8 - bit_count)) | (0xFF >> bit_count);
 	}
-	volatile char *character_buffer = (char *)(*CHARACTER_PTR + (y << 7) + x);
-	*character_buffer = c;
+	return out;
 }
 
-void clear_characters()
+int pack6_decode(const char *src, int length, char *dest, int size)
 {
-	// Character buffer x length is 80
-	// 					y length is 60
-	for (int x = 0; x < 80; x++)
+	// Returns the number of characters written to dest
+	const char *alphabet = PACK6_ALPHABET;
+	unsigned int bits = 0;
+	int bit_count = 0;
+	int out = 0;
+	int in = 0;
+	bool upper = false;
+
+	while (out < size)
 	{
-		for (int y = 0; y < 60; y++)
+		// Refill so a symbol and its escaped byte are both available
+		while (bit_count < 14 && in < length)
 		{
-			write_char(x, y, 0);
+			bits = (bits << 8) | (unsigned char)src[in++];
+			bit_count += 8;
+		}
+		if (bit_count < 6)
+		{
+			break;
+		}
+
+		unsigned char symbol = (bits >> (bit_count - 6)) & 0x3F;
+		if (symbol == PACK6_UPPER)
+		{
+			upper = true;
+			bit_count -= 6;
+		}
+		else if (symbol != PACK6_ESCAPE)
+		{
+			dest[out++] = upper ? alphabet[symbol] - ('a' - 'A') : alphabet[symbol];
+			upper = false;
+			bit_count -= 6;
+		}
+		else if (bit_count >= 14)
+		{
+			dest[out++] = bits >> (bit_count - 14);
+			bit_count -= 14;
+		}
+		else
+		{
+			break; // Padding
 		}
 	}
+	return out;
 }
 
-void write_word(int x, int y, char *word)
+bool send_frame(unsigned char type, const char *payload, int length)
 {
-	while (*word)
+	// Queues a frame that is delivered exactly once, in order. False when
+	// the queue is full and the frame was not taken.
+	if ((unsigned char)(tx_seq - tx_base) == TX_SLOTS)
 	{
-		write_char(x, y, *word);
-		x++;
-		word++;
+		stats.tx_dropped_frames++;
+		return false;
+	}
+	if (length > FRAME_MAX_PAYLOAD)
+	{
+		length = FRAME_MAX_PAYLOAD;
 	}
-}
 
-void initial_setup()
-{
-	clean_display();
-	draw_cursor(cursor_x, cursor_y);
-	draw_typing_border();
-	draw_logged_in_border();
-	write_word(2, 57, "Enter Message:");
-	whos_logged_in();
+	struct TxSlot *slot = &tx_slots[tx_seq & TX_SLOT_MASK];
+	slot->type = type;
+	slot->length = length;
+	memcpy(slot->payload, payload, length);
+	tx_seq++;
+	tx_fill_window();
+	return true;
 }
 
-void enter_delete_pressed()
+void tx_fill_window(void)
 {
-	clear_characters();
-	write_word(2, 57, "Enter Message:");
-	whos_logged_in();
+	// Put queued frames on the link while the window has room. Until the
+	// handshake is done they just wait in the queue.
+	if (!conn)
+	{
+		return;
+	}
+	while (tx_next != tx_seq && (unsigned char)(tx_next - tx_base) < TX_WINDOW)
+	{
+		struct TxSlot *slot = &tx_slots[tx_next & TX_SLOT_MASK];
+		frame_enqueue(slot->type, tx_next, slot->payload, slot->length);
+		tx_next++;
+	}
+	if (tx_base != tx_next && !retransmit_armed)
+	{
+		tx_arm_retransmit();
+	}
 }
 
-void clean_display()
+void tx_arm_retransmit(void)
 {
-	clear_screen();
-	clear_characters();
+	// The deadline is written before tick_ISR is allowed to look at it
+	retransmit_tick = tick_count + retransmit_ticks;
+	retransmit_armed = true;
 }
 
-void enter_name()
+void tx_acknowledged_to(unsigned char ack)
 {
-	clean_display();
-	write_word(25, 30, "Enter Your Name:");
-
-	// Loop until enter is pressed
-	while (last_pressed != 0X10 || buffer[0] == 0x10)
+	// Everything before ack has arrived
+	if (ack == tx_base && tx_base != tx_next)
 	{
-		int cursor_offset = buffer_index - 1;
-		cursor_toggle = 0;
-		draw_cursor(cursor_x + 4 * cursor_offset, cursor_y);
-
-		if (last_pressed == 0x08)
+		if (++repeated_acks == REPEATED_ACKS)
 		{
-			clean_display();
-			write_word(25, 30, "Enter Your Name:");
-			draw_cursor(cursor_x + 4 * (cursor_offset + 2), cursor_y);
-			last_pressed = -1;
+			tx_go_back();
 		}
-
-		write_word(43, 30, buffer);
-
-		cursor_toggle = 1;
-		draw_cursor(cursor_x + 4 * (cursor_offset + 1), cursor_y);
+		return;
+	}
+	if ((unsigned char)(ack - tx_base) > (unsigned char)(tx_next - tx_base))
+	{
+		return; // Stale
 	}
+	tx_base = ack;
+	repeated_acks = 0;
+	retransmit_ticks = RETRANSMIT_TICKS;
+	retransmit_armed = false;
+	tx_fill_window();
+}
 
-	last_pressed = -1;
-	strcpy(my_user_name, buffer);
+void handle_retransmit_event(void)
+{
+	if (!retransmit_armed || (int)(tick_count - retransmit_tick) < 0)
+	{
+		return;
+	}
+	retransmit_armed = false;
+	if (tx_base == tx_next)
+	{
+		return;
+	}
+	if (tx_queue_depth() > 0)
+	{
+		// Still going out, so the peer has had no chance to answer yet
+		tx_arm_retransmit();
+		return;
+	}
 
-	// Delay for visual effect
-	for (int i = 0; i < 1000000; i++)
+	if (retransmit_ticks < RETRANSMIT_MAX_TICKS)
 	{
+		retransmit_ticks *= 2;
 	}
+	repeated_acks = 0;
+	tx_go_back();
 }
 
-void whos_logged_in()
+void tx_go_back(void)
 {
-	char logged_in_text[256] = "Logged in as ";
-	char talking_to_text[256] = "Talking to ";
-
-	// Concatinating user names to display messages for VGA
-	strcat(logged_in_text, my_user_name);
-	strcat(talking_to_text, (char *)connected_user_name);
+	// Send everything unacknowledged again, from tx_base
+	stats.tx_retransmits += (unsigned char)(tx_next - tx_base);
+	tx_next = tx_base;
+	retransmit_armed = false;
+	tx_fill_window();
+}
 
-	write_word(2, 2, talking_to_text);
-	write_word(45, 2, logged_in_text);
+void link_start(void)
+{
+	// Called once the name is in. The session number is never 0, which
+	// stands for a peer not heard from yet.
+	unsigned short session;
+	do
+	{
+		session = read_cycles() ^ (tick_count << 3);
+	} while (session == 0);
+	link_session = session;
+	hello_tick = tick_count;
 }
 
-void test_messages(struct MessageNode *head)
-{
-	strcpy(messages[0].user_name, "Agrim");
-	strcpy(messages[0].message, "hi");
-	insertMessage(&head, messages[0]);
-	scrollCounter++;
-	strcpy(messages[1].user_name, "balls");
-	strcpy(messages[1].message, "balls");
-	insertMessage(&head, messages[1]);
-	scrollCounter++;
-	strcpy(messages[2].user_name, "lol");
-	strcpy(messages[2].message, "lol");
-	insertMessage(&head, messages[2]);
-	scrollCounter++;
-	strcpy(messages[3].user_name, "balls");
-	strcpy(messages[3].message, "lol");
-	insertMessage(&head, messages[3]);
-	scrollCounter++;
-	strcpy(messages[4].user_name, "balls");
-	strcpy(messages[4].message, "balls");
-	insertMessage(&head, messages[4]);
-	scrollCounter++;
-	strcpy(messages[5].user_name, "balls");
-	strcpy(messages[5].message, "balls");
-	insertMessage(&head, messages[5]);
-	scrollCounter++;
-	strcpy(messages[6].user_name, "balls");
-	strcpy(messages[6].message, "balls");
-	insertMessage(&head, messages[6]);
-	scrollCounter++;
-	strcpy(messages[7].user_name, "balls");
-	strcpy(messages[7].message, "balls");
-	insertMessage(&head, messages[7]);
-	scrollCounter++;
-	strcpy(messages[8].user_name, "balls");
-	strcpy(messages[8].message, "balls");
-	insertMessage(&head, messages[8]);
-	scrollCounter++;
-	strcpy(messages[9].user_name, "balls");
-	strcpy(messages[9].message, "balls");
-	insertMessage(&head, messages[9]);
-	scrollCounter++;
-	strcpy(messages[10].user_name, "balls");
-	strcpy(messages[10].message, "balls");
-	insertMessage(&head, messages[10]);
-	scrollCounter++;
-	strcpy(messages[11].user_name, "balls");
-	strcpy(messages[11].message, "balls");
-	insertMessage(&head, messages[11]);
-	scrollCounter++;
-	strcpy(messages[12].user_name, "balls");
-	strcpy(messages[12].message, "balls");
-	insertMessage(&head, messages[12]);
-	scrollCounter++;
-	strcpy(messages[13].user_name, "balls");
-	strcpy(messages[13].message, "balls");
-	insertMessage(&head, messages[13]);
-	scrollCounter++;
-	strcpy(messages[14].user_name, "balls");
-	strcpy(messages[14].message, "balls");
-	insertMessage(&head, messages[14]);
-	scrollCounter++;
-	strcpy(messages[15].user_name, "balls");
-	strcpy(messages[15].message, "balls");
-	insertMessage(&head, messages[15]);
-	scrollCounter++;
-	strcpy(messages[16].user_name, "balls");
-	strcpy(messages[16].message, "balls");
-	insertMessage(&head, messages[16]);
-	scrollCounter++;
-	strcpy(messages[17].user_name, "balls");
-	strcpy(messages[17].message, "balls");
-	insertMessage(&head, messages[17]);
-	scrollCounter++;
-	strcpy(messages[18].user_name, "balls");
-	strcpy(messages[18].message, "balls");
-	insertMessage(&head, messages[18]);
-	scrollCounter++;
-	strcpy(messages[19].user_name, "balls");
-	strcpy(messages[19].message, "balls");
-	insertMessage(&head, messages[19]);
-	scrollCounter++;
-	strcpy(messages[20].user_name, "balls");
-	strcpy(messages[20].message, "balls");
-	insertMessage(&head, messages[20]);
-	scrollCounter++;
-	strcpy(messages[21].user_name, "balls");
-	strcpy(messages[21].message, "balls");
-	insertMessage(&head, messages[21]);
-	scrollCounter++;
-	strcpy(messages[22].user_name, "balls");
-	strcpy(messages[22].message, "balls");
-	insertMessage(&head, messages[22]);
-	scrollCounter++;
-	strcpy(messages[23].user_name, "balls");
-	strcpy(messages[23].message, "balls");
-	insertMessage(&head, messages[23]);
-	scrollCounter++;
-	strcpy(messages[24].user_name, "balls");
-	strcpy(messages[24].message, "balls");
-	insertMessage(&head, messages[24]);
-	scrollCounter++;
-	strcpy(messages[25].user_name, "balls");
-	strcpy(messages[25].message, "balls");
-	insertMessage(&head, messages[25]);
-	scrollCounter++;
-	strcpy(messages[26].user_name, "balls");
-	strcpy(messages[26].message, "balls");
-	insertMessage(&head, messages[26]);
-	scrollCounter++;
-	strcpy(messages[27].user_name, "balls");
-	strcpy(messages[27].message, "balls");
-	insertMessage(&head, messages[27]);
-	scrollCounter++;
-	strcpy(messages[28].user_name, "balls");
-	strcpy(messages[28].message, "balls");
-	insertMessage(&head, messages[28]);
-	scrollCounter++;
-	strcpy(messages[29].user_name, "balls");
-	strcpy(messages[29].message, "balls");
-	insertMessage(&head, messages[29]);
-	scrollCounter++;
-	strcpy(messages[30].user_name, "balls");
-	strcpy(messages[30].message, "balls");
-	insertMessage(&head, messages[30]);
-	scrollCounter++;
-	printMessages(head);
+void link_up(struct Frame *frame, unsigned short session)
+{
+	// The peer's name comes with its hello
+	int length = frame->length - HELLO_HEADER_SIZE;
+	if (length > BUFFER_SIZE - 1)
+	{
+		length = BUFFER_SIZE - 1;
+	}
+	memcpy((char *)connected_user_name, frame->payload + HELLO_HEADER_SIZE, length);
+	connected_user_name[length] = 0;
+	peer_session = session;
 
-	// write_word(2, 49, "Connection One >> Message One");
-	// write_word(2, 51, "Connection Two >> Message Two");
+	conn = 1;
+	link_heard_tick = tick_count;
+	if (stats.link_connects++ == 0)
+	{
+		stats.connect_ticks = tick_count;
+	}
+
+	// Whatever the peer has not acknowledged goes out again
+	retransmit_ticks = RETRANSMIT_TICKS;
+	repeated_acks = 0;
+	tx_go_back();
+	mark_dirty(REGION_HEADER);
 }
 
-void detect_connection()
+void link_down(void)
 {
-	clean_display();
-
-	// All of this should be in a while loop waiting until GPIO is detected
-	write_word(25, 30, "Waiting for a connection...");
+	// Bytes still waiting for the link belong to the old session
+	conn = 0;
+	stats.link_drops++;
+	NIOS2_WRITE_STATUS(0);
+	tx_tail = tx_head;
+	NIOS2_WRITE_STATUS(1);
+	retransmit_armed = false;
+	hello_tick = tick_count;
+	mark_dirty(REGION_HEADER);
+}
 
-	while (conn == 0)
+void link_hello(struct Frame *frame)
+{
+	if (link_session == 0)
 	{
+		return; // No name to answer with yet
 	}
-
-	for (int i = 0; i < received_index_saver; i++)
+	if (frame->length < HELLO_HEADER_SIZE || frame->payload[0] != PROTOCOL_VERSION)
 	{
-		connected_user_name[i] = received_buffer[i];
+		stats.link_rejected++;
+		return;
 	}
+	unsigned short session = ((unsigned char)frame->payload[1] << 8) | (unsigned char)frame->payload[2];
+	unsigned short known = ((unsigned char)frame->payload[3] << 8) | (unsigned char)frame->payload[4];
+	unsigned char next_seq = frame->payload[5];
+	unsigned char expected_seq = frame->payload[6];
 
-	// Delay for visual effect
-	for (int i = 0; i < 10000000; i++)
+	if (frame->type == FRAME_HELLO_ACK && (conn || known != link_session))
 	{
+		return; // A repeat, or not an answer to us
+	}
+	if (frame->type == FRAME_HELLO && conn && session == peer_session)
+	{
+		send_hello(FRAME_HELLO_ACK, session); // Our answer was lost
+		return;
 	}
 
-	char connected_text[BUFFER_SIZE] = "You are talking to ";
-	strcat(connected_text, (char *)connected_user_name);
-
-	write_word(25, 30, connected_text);
-
-	for (int i = 0; i < 20000000; i++)
+	// A peer that has been reset numbers its frames from where its hello
+	// says. One that knows us says how far it got with ours, and the answer
+	// carries that after the sender has caught up.
+	if (session != peer_session)
 	{
+		rx_expected_seq = next_seq;
+	}
+	if (known == link_session && (unsigned char)(expected_seq - tx_base) <= (unsigned char)(tx_next - tx_base))
+	{
+		tx_base = expected_seq;
 	}
-}
 
-struct MessageNode *createMessage(struct Message m)
-{
-	struct MessageNode *newMessage = (struct MessageNode *)malloc(sizeof(struct MessageNode));
-	if (newMessage == NULL)
+	// The answer goes ahead of the frames sent again
+	if (frame->type == FRAME_HELLO)
 	{
-		printf("Memory allocation failed.\n");
-		exit(1);
+		send_hello(FRAME_HELLO_ACK, session);
 	}
-	newMessage->message = m;
-	newMessage->next = NULL;
-	return newMessage;
+	link_up(frame, session);
 }
 
-void insertMessage(struct MessageNode **head, struct Message m)
+void send_hello(unsigned char type, unsigned short known)
 {
-	struct MessageNode *newNode = createMessage(m);
-	newNode->next = *head;
-	*head = newNode;
+	char payload[FRAME_MAX_PAYLOAD];
+	int length = strnlen(my_user_name, FRAME_MAX_PAYLOAD - HELLO_HEADER_SIZE);
+	payload[0] = PROTOCOL_VERSION;
+	payload[1] = link_session >> 8;
+	payload[2] = link_session & 0xFF;
+	payload[3] = known >> 8;
+	payload[4] = known & 0xFF;
+	payload[5] = tx_base;
+	payload[6] = rx_expected_seq;
+	memcpy(payload + HELLO_HEADER_SIZE, my_user_name, length);
+	frame_enqueue(type, 0, payload, HELLO_HEADER_SIZE + length);
 }
 
-void printMessages(struct MessageNode *head)
+void handle_link_event(void)
 {
-	// initial_setup();
-	// whos_logged_in();
-	struct MessageNode *current = head;
-	int i = 0;
-	while (current != NULL && i < scrollCounter)
+	if (conn && tick_count - link_heard_tick >= LINK_TIMEOUT_TICKS)
+	{
+		link_down();
+	}
+
+	if (conn)
+	{
+		if (tick_count - link_sent_tick >= HEARTBEAT_TICKS)
+		{
+			frame_enqueue(FRAME_HEARTBEAT, 0, NULL, 0);
+		}
+	}
+	else if (link_session != 0 && (int)(tick_count - hello_tick) >= 0)
 	{
-		show_message(current, i);
-		i++;
-		current = current->next;
+		// Hellos don't pile up behind a peer that is not taking them
+		hello_tick = tick_count + HELLO_TICKS;
+		if (tx_queue_depth() == 0)
+		{
+			send_hello(FRAME_HELLO, peer_session);
+		}
 	}
 }
 
-void show_message(struct MessageNode *m, int counter)
+void frame_enqueue(unsigned char type, unsigned char seq, const char *payload, int length)
 {
-	int spacing = 51 - (counter * 2);
-	if (spacing > 51 || spacing < 7)
+	stats.tx_payload_bytes += length;
+
+	// Send text packed whenever that is shorter
+	char packed[FRAME_MAX_PAYLOAD];
+	int packed_length = length > 1 ? pack6_encode(payload, length, packed, length - 1) : -1;
+	if (packed_length >= 0)
+	{
+		type |= FRAME_PACKED;
+		payload = packed;
+		length = packed_length;
+	}
+
+	// A frame that does not fit is dropped whole rather than cut short. Data
+	// frames are still queued and go out again on the retransmit timeout.
+	if (TX_RING_SIZE - tx_queue_depth() < (unsigned int)length + FRAME_OVERHEAD)
 	{
+		stats.tx_dropped_bytes += length + FRAME_OVERHEAD;
 		return;
 	}
-	char message[600] = "";
-	strcat(message, m->message.user_name);
-	strcat(message, " >> ");
-	strcat(message, m->message.message);
-	write_word(2, spacing, message);
-}
 
-/* PROGRAM STARTS HERE */
-int main(void)
-{
+	stats.tx_packed_bytes += length;
+	link_sent_tick = tick_count;
 
-	// Clean the display
-	clean_display();
+	unsigned short crc = 0xFFFF;
+	crc = crc16_update(crc, type);
+	crc = crc16_update(crc, length);
+	crc = crc16_update(crc, seq);
 
-	*(volatile int *)(GPIO_BASE + 0x04) = 0xFF; // Configure GPIO direction as needed
-	unsigned int ienable = (1 << PS2_IRQ) | (1 << GPIO_IRQ);
-	*(volatile int *)(PS2_BASE + 0x04) |= 0x1; // Configure PS2 as needed
-	NIOS2_WRITE_IENABLE(ienable);
-	NIOS2_WRITE_STATUS(1); // Enable Nios II interrupts
-	*(volatile int *)(GPIO_BASE + 0x08) |= 0xFF00;
+	tx_enqueue(FRAME_SYNC);
+	tx_enqueue(type);
+	tx_enqueue(length);
+	tx_enqueue(seq);
+	for (int i = 0; i < length; i++)
+	{
+		tx_enqueue(payload[i]);
+		crc = crc16_update(crc, payload[i]);
+	}
+	tx_enqueue(crc >> 8);
+	tx_enqueue(crc & 0xFF);
+	tx_start();
+}
 
-	// setting current cursor position
-	cursor_toggle = 1;
-	cursor_x = 172;
-	cursor_y = 116;
+bool rx_pop_frame(struct Frame *frame)
+{
+	while (1)
+	{
+		// Drop anything before the next sync byte
+		unsigned int head = rx_head;
+		while (rx_tail != head && rx_ring[rx_tail & RX_RING_MASK] != FRAME_SYNC)
+		{
+			rx_tail++;
+		}
 
-	// Enter your name
-	enter_name();
+		unsigned int available = head - rx_tail;
+		if (available < FRAME_HEADER_SIZE)
+		{
+			rx_release();
+			return false;
+		}
 
-	// Finding connection between
-	// If GPIO is detected, show connected
-	// need function here to detect that
-	// set the connected person name
-	cursor_toggle = 0;
-	draw_cursor_colour();
-	detect_connection();
+		// The length byte says how much more to wait for. If the link has gone
+		// quiet first, the length was garbled.
+		int length = (unsigned char)rx_ring[(rx_tail + 2) & RX_RING_MASK];
+		if (available < (unsigned int)(length + FRAME_OVERHEAD))
+		{
+			if (tick_count - rx_last_tick >= RX_STALL_TICKS)
+			{
+				stats.rx_corrupt_frames++;
+				rx_tail++;
+				continue;
+			}
+			rx_release();
+			return false;
+		}
 
-	// setting current cursor position
-	cursor_toggle = 1;
-	cursor_x = 64;
-	cursor_y = 224;
+		unsigned short crc = 0xFFFF;
+		for (int i = 1; i < length + FRAME_HEADER_SIZE; i++)
+		{
+			crc = crc16_update(crc, rx_ring[(rx_tail + i) & RX_RING_MASK]);
+		}
+		unsigned short received_crc = ((unsigned char)rx_ring[(rx_tail + length + 4) & RX_RING_MASK] << 8) |
+									  (unsigned char)rx_ring[(rx_tail + length + 5) & RX_RING_MASK];
 
-	// Clearing screen and drawing borders/cursor
-	initial_setup();
+		if (crc != received_crc)
+		{
+			// Not a frame after all, resynchronise on the following sync byte
+			stats.rx_corrupt_frames++;
+			rx_tail++;
+			continue;
+		}
 
-	// Testing messages
-	struct MessageNode *head = NULL;
-	// printf("%d\n", head);
-	// test_messages(head);
-	// printf("%d\n", head);
+		frame->type = rx_ring[(rx_tail + 1) & RX_RING_MASK];
+		frame->length = length;
+		frame->seq = rx_ring[(rx_tail + 3) & RX_RING_MASK];
+		for (int i = 0; i < length; i++)
+		{
+			frame->payload[i] = rx_ring[(rx_tail + FRAME_HEADER_SIZE + i) & RX_RING_MASK];
+		}
+		frame->payload[length] = 0;
 
-	last_pressed = -1;
-	memset(buffer, 0, BUFFER_SIZE);
-	memset((char *)received_buffer, 0, BUFFER_SIZE);
-	while (1)
-	{
-		int cursor_offset = buffer_index;
+		if (frame->type & FRAME_PACKED)
+		{
+			char packed[FRAME_MAX_PAYLOAD];
+			memcpy(packed, frame->payload, length);
+			frame->length = pack6_decode(packed, length, frame->payload, FRAME_MAX_PAYLOAD);
+			frame->payload[frame->length] = 0;
+			frame->type &= ~FRAME_PACKED;
+		}
+
+		rx_tail += length + FRAME_OVERHEAD; // Hand the space back to the ISR
+		rx_release();
+		stats.rx_frames++;
+		link_heard_tick = tick_count;
 
-		cursor_toggle = 0;
-		draw_cursor(cursor_x + 4 * cursor_offset, cursor_y);
+		// Connection frames are outside the sequence. Anything else is left
+		// unanswered until the handshake is done, and is sent again after it.
+		if (frame->type == FRAME_HELLO || frame->type == FRAME_HELLO_ACK)
+		{
+			link_hello(frame);
+			continue;
+		}
+		if (frame->type == FRAME_HEARTBEAT || !conn)
+		{
+			continue;
+		}
+		if (frame->type == FRAME_ACK)
+		{
+			tx_acknowledged_to(frame->seq);
+			continue;
+		}
 
-		// If a message is received or entered, display it
-		if (received_buffer[received_index_saver - 1] == 0x10)
+		// Only the next frame in sequence is taken. Every data frame is
+		// answered, so a lost ACK is made up for by the next one.
+		bool in_sequence = frame->seq == rx_expected_seq;
+		if (in_sequence)
+		{
+			rx_expected_seq++;
+		}
+		else if ((signed char)(frame->seq - rx_expected_seq) < 0)
 		{
-			strcpy(messages[messageCounter].user_name, (char *)connected_user_name);
-			strcpy(messages[messageCounter].message, (char *)received_buffer);
-			insertMessage(&head, messages[messageCounter]);
-			scrollCounter++;
-			messageCounter++;
-			received_index_saver = -1; // not sure what this does
-			memset((char *)received_buffer, 0, BUFFER_SIZE);
-			initial_setup();
+			stats.rx_duplicates++;
 		}
-		else if (last_pressed == 0x10 && buffer[0] != 0x10)
+		else
 		{
-			strcpy(messages[messageCounter].user_name, my_user_name);
-			strcpy(messages[messageCounter].message, buffer);
-			insertMessage(&head, messages[messageCounter]);
-			scrollCounter++;
-			messageCounter++;
-			initial_setup();
-			last_pressed = -1;
-			memset(buffer, 0, BUFFER_SIZE);
+			stats.rx_seq_gaps++;
 		}
-		else if (last_pressed == 0x08)
+		frame_enqueue(FRAME_ACK, rx_expected_seq, NULL, 0);
+		if (in_sequence)
 		{
-			initial_setup();
-			draw_cursor(cursor_x + 4 * (cursor_offset + 2), cursor_y);
-			last_pressed = -1;
+			return true;
 		}
+	}
+}
 
-		write_word(17, 57, buffer);
+void ps2_ISR(void)
+{
+	// PS2 interrupt service routine, only queues the scan code
+	unsigned int start = read_cycles();
+	int PS2_data, RVALID;
+	PS2_data = IO_READ(PS2_PTR);
+	RVALID = (PS2_data & 0x8000);
 
-		cursor_toggle = 1;
-		draw_cursor(cursor_x + 4 * (cursor_offset + 1), cursor_y);
-		printMessages(head);
+	if (RVALID)
+	{
+		if (kb_head - kb_tail == KB_RING_SIZE)
+		{
+			stats.kb_dropped_codes++;
+		}
+		else
+		{
+			kb_ring[kb_head & KB_RING_MASK] = PS2_data & 0xFF;
+#if PROFILE
+			kb_cycles[kb_head & KB_RING_MASK] = start;
+#endif
+			kb_head++;
+			post_event(EVENT_KEY);
+		}
 	}
 
-	// if up arrow is pressed, scrollCounter++, else scrollCounter--
-	// main loop will be a while loop that waits for keyboard input
-	// if no keyboard input the cursor will blink
-	// when there is a keyboard input the cursor will toggle to white
+	unsigned int elapsed = read_cycles() - start;
+	if (elapsed > stats.ps2_isr_max_cycles)
+	{
+		stats.ps2_isr_max_cycles = elapsed;
+	}
+}
+
+void process_keyboard(void)
+{
+	while (kb_tail != kb_head)
+	{
+		process_next_key();
+	}
+}
+
+void process_next_key(void)
+{
+	char scanCode = kb_ring[kb_tail & KB_RING_MASK];
+#if PROFILE
+	if (!key_waiting)
+	{
+		key_cycles = kb_cycles[kb_tail & KB_RING_MASK];
+	}
+#endif
+	kb_tail++;
+	handle_scan_code(scanCode);
+}
+
+void handle_scan_code(char scanCode)
+{
+	int key = decode_scan_code(scanCode);
+	if (key == 0)
+	{
+		return;
+	}
+	last_pressed = key;
+#if PROFILE
+	key_waiting = true;
+#endif
+
+	switch (key)
+	{
+	case KEY_F1:
+		hud_visible = !hud_visible;
+		mark_dirty(REGION_HUD);
+		break;
+#if PROFILE
+	case KEY_F1 + 1:
+		profile_dump();
+		break;
+#endif
+	case KEY_F1 + 2:
+		// Takes effect from the next line
+		stream_typing = !stream_typing;
+		mark_dirty(REGION_INPUT);
+		break;
+	case KEY_F1 + 3:
+		search_active = !search_active;
+		search_length = 0;
+		search_query[0] = 0;
+		run_search();
+		break;
+	case KEY_UP:
+		scroll_messages(1);
+		break;
+	case KEY_DOWN:
+		scroll_messages(-1);
+		break;
+	case KEY_PAGE_UP:
+		scroll_messages(PAGE_ROWS);
+		break;
+	case KEY_PAGE_DOWN:
+		scroll_messages(-PAGE_ROWS);
+		break;
+	default:
+		if (search_active)
+		{
+			search_key(key);
+		}
+		else
+		{
+			edit_buffer(key);
+		}
+		break;
+	}
+}
+
+void edit_buffer(int key)
+{
+	// Only the input line changes while typing
+	mark_dirty(REGION_INPUT);
+
+	switch (key)
+	{
+	case KEY_BACKSPACE:
+		if (edit_pos > 0)
+		{
+			memmove(buffer + edit_pos - 1, buffer + edit_pos, buffer_index - edit_pos + 1);
+			edit_pos--;
+			buffer_index--;
+			stream_edit(FRAME_TYPING_DELETE, edit_pos, 0);
+		}
+		break;
+	case KEY_DELETE:
+		if (edit_pos < buffer_index)
+		{
+			memmove(buffer + edit_pos, buffer + edit_pos + 1, buffer_index - edit_pos);
+			buffer_index--;
+			stream_edit(FRAME_TYPING_DELETE, edit_pos, 0);
+		}
+		break;
+	case KEY_LEFT:
+		if (edit_pos > 0)
+		{
+			edit_pos--;
+		}
+		break;
+	case KEY_RIGHT:
+		if (edit_pos < buffer_index)
+		{
+			edit_pos++;
+		}
+		break;
+	case KEY_HOME:
+		edit_pos = 0;
+		break;
+	case KEY_END:
+		edit_pos = buffer_index;
+		break;
+	case KEY_ENTER:
+		// Until there is a name, enter_name takes the line as it stands
+		if (my_user_name[0] != 0)
+		{
+			send_data_to_gpio();
+		}
+		break;
+	default:
+		// Printable characters are inserted at the caret, leaving room for
+		// the terminator
+		if (key >= ' ' && key < 0x7F && buffer_index < BUFFER_SIZE - 1)
+		{
+			memmove(buffer + edit_pos + 1, buffer + edit_pos, buffer_index - edit_pos + 1);
+			buffer[edit_pos] = key;
+			stream_edit(FRAME_TYPING_INSERT, edit_pos, key);
+			edit_pos++;
+			buffer_index++;
+		}
+		break;
+	}
+}
+
+void interrupt_handler(void)
+{
+	unsigned int handler_start = read_cycles();
+	int ipending;
+	NIOS2_READ_IPENDING(ipending);
+	if (ipending & (1 << PS2_IRQ))
+	{ // Check if PS2 interrupt
+		PROFILE_START(isr_start);
+		ps2_ISR();
+		PROFILE_END(HIST_PS2_ISR, isr_start);
+	}
+	if (ipending & (1 << GPIO_IRQ))
+	{ // Check if GPIO interrupt
+		PROFILE_START(isr_start);
+		gpio_ISR();
+		PROFILE_END(HIST_GPIO_ISR, isr_start);
+	}
+	if (ipending & (1 << TIMER_IRQ))
+	{ // Check if timer interrupt, after GPIO so an acknowledge wins over its timeout
+		PROFILE_START(isr_start);
+		timer_ISR();
+		PROFILE_END(HIST_TIMER_ISR, isr_start);
+	}
+	if (ipending & (1 << TIMER2_IRQ))
+	{
+		PROFILE_START(isr_start);
+		tick_ISR();
+		PROFILE_END(HIST_TICK_ISR, isr_start);
+	}
+	// Handle other interrupts as needed
+	unsigned int handler_cycles = read_cycles() - handler_start;
+	stats.isr_cycles += handler_cycles;
+	PROFILE_RECORD(HIST_HANDLER, handler_cycles);
+}
+
+void tick_ISR(void)
+{
+#if PROFILE
+	// The count since the timer wrapped is how long the interrupt waited
+	IO_WRITE(TIMER2_PTR + 4, 0);
+	unsigned int count = (IO_READ(TIMER2_PTR + 5) << 16) | (IO_READ(TIMER2_PTR + 4) & 0xFFFF);
+	profile_record(HIST_IRQ_LATENCY, TICK_PERIOD - 1 - count);
+
+	// A frame with a new key in it is on screen once its swap is done
+	if (key_swap_waiting && !pixel_dma_swap_pending())
+	{
+		profile_record(HIST_KEY_TO_SCREEN, read_cycles() - key_swap_cycles);
+		key_swap_waiting = false;
+	}
+#endif
+
+	IO_WRITE(TIMER2_PTR, 0); // Clear the timeout bit
+	tick_count++;
+
+	if (++blink_ticks == BLINK_TICKS)
+	{
+		blink_ticks = 0;
+		post_event(EVENT_BLINK);
+	}
+	if (dirty_regions)
+	{
+		post_event(EVENT_TICK);
+	}
+#if PROFILE
+	if (profile_out_head != profile_out_tail)
+	{
+		post_event(EVENT_PROFILE);
+	}
+#endif
+	if (retransmit_armed && (int)(tick_count - retransmit_tick) >= 0)
+	{
+		post_event(EVENT_RETRANSMIT);
+	}
+	if (tick_count - rx_last_tick == RX_STALL_TICKS && rx_head != rx_tail)
+	{
+		post_event(EVENT_RX); // Lets rx_pop_frame give up on a partial frame
+	}
+	if (conn ? tick_count - link_sent_tick >= HEARTBEAT_TICKS || tick_count - link_heard_tick >= LINK_TIMEOUT_TICKS
+			 : link_session != 0 && (int)(tick_count - hello_tick) >= 0)
+	{
+		post_event(EVENT_LINK);
+	}
+}
+
+void post_event(int type)
+{
+	// Only called from ISRs, which do not nest
+	if (event_queued & (1 << type))
+	{
+		return;
+	}
+	event_queued |= 1 << type;
+	event_ring[event_head & EVENT_RING_MASK] = type;
+	event_head++;
+}
+
+int wait_for_event(void)
+{
+	// Nios II has no sleep instruction, so idling is a spin on the ring
+	if (event_tail == event_head)
+	{
+		unsigned int start = read_cycles();
+		while (event_tail == event_head)
+		{
+		}
+		stats.idle_cycles += read_cycles() - start;
+	}
+
+	// Clear the queued bit first, so anything arriving while the event is
+	// handled queues it again
+	NIOS2_WRITE_STATUS(0);
+	int type = event_ring[event_tail & EVENT_RING_MASK];
+	event_tail++;
+	event_queued &= ~(1 << type);
+	NIOS2_WRITE_STATUS(1);
+
+	stats.events_handled++;
+	return type;
+}
+
+void handle_key_event(void)
+{
+	process_keyboard();
+	cursor_toggle = 1;
+	last_key_tick = tick_count;
+}
+
+void handle_rx_event(void)
+{
+	// Payloads land straight in the next arena slot and are kept only if
+	// they are chat
+	struct Frame frame;
+	frame.payload = message_reserve();
+	while (rx_pop_frame(&frame))
+	{
+		RX_DELAY();
+		if (frame.type == FRAME_TYPING_COMMIT && peer_preview_length > 0)
+		{
+			// The finished preview becomes the message
+			memcpy(frame.payload, peer_preview, peer_preview_length);
+			frame.type = FRAME_MESSAGE;
+			frame.length = peer_preview_length;
+		}
+		if (frame.type == FRAME_MESSAGE)
+		{
+			message_commit(intern_sender((char *)connected_user_name), frame.length);
+			log_append(get_message(next_message_id - 1));
+			mark_dirty(REGION_MESSAGES);
+			frame.payload = message_reserve();
+		}
+		if (frame.type == FRAME_MESSAGE || frame.type == FRAME_TYPING_COMMIT)
+		{
+			// A whole message also replaces a preview left unfinished
+			peer_preview_length = 0;
+			mark_dirty(REGION_PREVIEW);
+		}
+		else if (frame.type == FRAME_TYPING_INSERT || frame.type == FRAME_TYPING_DELETE)
+		{
+			preview_edit(&frame);
+			mark_dirty(REGION_PREVIEW);
+		}
+	}
+}
+
+void preview_edit(struct Frame *frame)
+{
+	// Apply one of the peer's edits. Positions are checked, as the frame
+	// only promises to be what the peer sent.
+	int position = (unsigned char)frame->payload[0];
+	if (frame->type == FRAME_TYPING_INSERT && frame->length == 2 && position <= peer_preview_length &&
+		peer_preview_length < FRAME_MAX_PAYLOAD)
+	{
+		memmove(peer_preview + position + 1, peer_preview + position, peer_preview_length - position);
+		peer_preview[position] = frame->payload[1];
+		peer_preview_length++;
+	}
+	else if (frame->type == FRAME_TYPING_DELETE && frame->length == 1 && position < peer_preview_length)
+	{
+		memmove(peer_preview + position, peer_preview + position + 1, peer_preview_length - position - 1);
+		peer_preview_length--;
+	}
+}
+
+void handle_blink_event(void)
+{
+	if (tick_count - last_key_tick >= BLINK_TICKS)
+	{
+		cursor_toggle = !cursor_toggle;
+		mark_dirty(REGION_INPUT);
+	}
+	update_load_stats();
+}
+
+void update_load_stats(void)
+{
+	unsigned int ticks = tick_count - load_window_tick;
+	if (ticks < TICKS_PER_SECOND)
+	{
+		return;
+	}
+
+	unsigned int now = read_cycles();
+	unsigned int cycles = now - load_window_cycles;
+	stats.events_per_second = (stats.events_handled - load_window.events_handled) * TICKS_PER_SECOND / ticks;
+	stats.idle_percent = (unsigned long long)(stats.idle_cycles - load_window.idle_cycles) * 100 / cycles;
+	stats.isr_permille = (unsigned long long)(stats.isr_cycles - load_window.isr_cycles) * 1000 / cycles;
+	stats.rx_bytes_per_second = (stats.rx_bytes - load_window.rx_bytes) * TICKS_PER_SECOND / ticks;
+	stats.tx_bytes_per_second = (stats.tx_bytes_sent - load_window.tx_bytes_sent) * TICKS_PER_SECOND / ticks;
+	stats.message_rate = (stats.messages_stored - load_window.messages_stored) * 10 * TICKS_PER_SECOND / ticks;
+
+	load_window_tick += ticks;
+	load_window_cycles = now;
+	load_window = stats;
+
+	if (hud_visible)
+	{
+		mark_dirty(REGION_HUD);
+	}
+}
+
+void draw_preview(void)
+{
+	// The peer's name and as much of the end of its line as fits
+	if (peer_preview_length == 0)
+	{
+		return;
+	}
+	int shown = strnlen((char *)connected_user_name, SENDER_SHOWN);
+	write_span(TEXT_COLUMN, PREVIEW_ROW, (char *)connected_user_name, shown);
+	write_span(TEXT_COLUMN + shown, PREVIEW_ROW, " is typing: ", 12);
+
+	int x = TEXT_COLUMN + shown + 12;
+	int room = TEXT_COLUMN + TEXT_WIDTH - x;
+	int start = peer_preview_length > room ? peer_preview_length - room : 0;
+	write_span(x, PREVIEW_ROW, peer_preview + start, peer_preview_length - start);
+}
+
+void draw_hud(void)
+{
+	// Two rows under the names. Only the cells that changed reach the screen.
+	// The line fits every counter at its widest and is then cut at the edge.
+	char line[192];
+	snprintf(line, sizeof(line), "rx %5u B/s  tx %5u B/s  msgs %u.%u/s  rxq %4u  txq %4u  frame %u/%u us",
+			 stats.rx_bytes_per_second, stats.tx_bytes_per_second, stats.message_rate / 10, stats.message_rate % 10,
+			 rx_head - rx_tail, tx_queue_depth(), stats.last_frame_cycles / CPU_MHZ, stats.max_frame_cycles / CPU_MHZ);
+	line[CHAR_COLUMNS - 2] = 0;
+	write_word(2, 3, line);
+	snprintf(line, sizeof(line), "dropped rx %u tx %u kb %u  corrupt %u  resent %u  timeouts %u  isr %u.%u%%  idle %u%%",
+			 stats.rx_dropped_bytes, stats.tx_dropped_bytes, stats.kb_dropped_codes, stats.rx_corrupt_frames,
+			 stats.tx_retransmits, stats.tx_ack_timeouts, stats.isr_permille / 10, stats.isr_permille % 10, stats.idle_percent);
+	line[CHAR_COLUMNS - 2] = 0;
+	write_word(2, 4, line);
+}
+
+#if PROFILE
+void profile_record(int hist, unsigned int cycles)
+{
+	struct Histogram *h = &histograms[hist];
+	h->count++;
+	if (cycles > h->max)
+	{
+		h->max = cycles;
+	}
+	int bucket = cycles ? 32 - __builtin_clz(cycles) : 0;
+	h->buckets[bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1]++;
+}
+
+void profile_write(const char *text)
+{
+	for (; *text && profile_out_head - profile_out_tail < PROFILE_OUT_SIZE; text++)
+	{
+		profile_out[profile_out_head++ & PROFILE_OUT_MASK] = *text;
+	}
+}
+
+#ifndef HOST_BUILD
+void profile_drain(void)
+{
+	// As much as the FIFO takes now, the rest on later ticks
+	unsigned int space = IO_READ(JTAG_UART_PTR + 1) >> 16;
+	for (; space > 0 && profile_out_tail != profile_out_head; space--)
+	{
+		IO_WRITE(JTAG_UART_PTR, profile_out[profile_out_tail++ & PROFILE_OUT_MASK]);
+	}
+}
+#endif
+
+void profile_dump(void)
+{
+	// Startup first, then non-empty buckets only, as [low, high) cycle ranges.
+	// Only formats the text; profile_drain sends it.
+	char line[96];
+	snprintf(line, sizeof(line), "startup: name at %u ms, connected at %u ms, ready at %u ms\n",
+			 stats.name_ticks * 1000 / TICKS_PER_SECOND, stats.connect_ticks * 1000 / TICKS_PER_SECOND,
+			 stats.ready_ticks * 1000 / TICKS_PER_SECOND);
+	profile_write(line);
+	for (int i = 0; i < HIST_COUNT; i++)
+	{
+		struct Histogram *h = &histograms[i];
+		snprintf(line, sizeof(line), "%s: %u samples, max %u cycles\n", histogram_names[i], h->count, h->max);
+		profile_write(line);
+		for (int b = 0; b < HIST_BUCKETS; b++)
+		{
+			if (h->buckets[b])
+			{
+				snprintf(line, sizeof(line), "  %10u - %10u: %u\n", b ? 1u << (b - 1) : 0, (1u << b) - 1, h->buckets[b]);
+				profile_write(line);
+			}
+		}
+	}
+}
+#endif
+
+void plot_pixel(int x, int y, short int pixel_color)
+{
+	if (x < 0 || x >= SCREEN_WIDTH || y < 0 || y >= SCREEN_HEIGHT)
+	{
+		return;
+	}
+
+	volatile short int *one_pixel_address;
+
+	// set the address of the pixel to the buffer start plus its x and y coordinate
+	one_pixel_address = pixel_buffer_start + (y << 9) + x;
+
+	// dereferencing the pixel address allows us to modify the pixel colour
+	*one_pixel_address = pixel_color;
+}
+
+void fill_span(int x0, int x1, int y, short int colour)
+{
+	// Clip to the screen
+	if (y < 0 || y >= SCREEN_HEIGHT)
+	{
+		return;
+	}
+	if (x0 < 0)
+	{
+		x0 = 0;
+	}
+	if (x1 >= SCREEN_WIDTH)
+	{
+		x1 = SCREEN_WIDTH - 1;
+	}
+	if (x0 > x1)
+	{
+		return;
+	}
+
+	volatile short int *pixel = pixel_buffer_start + (y << 9) + x0;
+
+	// Align to a word so the middle of the span is written two pixels at a time
+	if (x0 & 1)
+	{
+		*pixel++ = colour;
+		x0++;
+	}
+
+	unsigned int pair = ((unsigned int)(unsigned short)colour << 16) | (unsigned short)colour;
+	volatile unsigned int *pixel_pair = (volatile unsigned int *)pixel;
+	for (; x0 < x1; x0 += 2)
+	{
+		*pixel_pair++ = pair;
+	}
+
+	if (x0 == x1)
+	{
+		*(volatile short int *)pixel_pair = colour;
+	}
+}
+
+void fill_rect(int x0, int y0, int x1, int y1, short int colour)
+{
+	if (y0 < 0)
+	{
+		y0 = 0;
+	}
+	if (y1 >= SCREEN_HEIGHT)
+	{
+		y1 = SCREEN_HEIGHT - 1;
+	}
+
+	for (int y = y0; y <= y1; y++)
+	{
+		fill_span(x0, x1, y, colour);
+	}
+}
+
+void draw_hline(int x0, int x1, int y, short int colour)
+{
+	if (x0 > x1)
+	{
+		swap(&x0, &x1);
+	}
+	fill_span(x0, x1, y, colour);
+}
+
+void draw_vline(int x, int y0, int y1, short int colour)
+{
+	if (y0 > y1)
+	{
+		swap(&y0, &y1);
+	}
+
+	// Clip to the screen
+	if (x < 0 || x >= SCREEN_WIDTH)
+	{
+		return;
+	}
+	if (y0 < 0)
+	{
+		y0 = 0;
+	}
+	if (y1 >= SCREEN_HEIGHT)
+	{
+		y1 = SCREEN_HEIGHT - 1;
+	}
+
+	volatile short int *pixel = pixel_buffer_start + (y0 << 9) + x;
+	for (int y = y0; y <= y1; y++)
+	{
+		*pixel = colour;
+		pixel += 512;
+	}
+}
+
+void clear_screen()
+{
+	fill_rect(0, 0, SCREEN_WIDTH - 1, SCREEN_HEIGHT - 1, 0x0000);
+}
+
+void swap(int *x, int *y)
+{
+	int temp = *x;
+	*x = *y;
+	*y = temp;
+}
+
+// Using Bresenham's Algorithm to draw lines
+void draw_line(int x0, int y0, int x1, int y1, short int line_color)
+{
+	// Axis-aligned lines are plain spans
+	if (y0 == y1)
+	{
+		draw_hline(x0, x1, y0, line_color);
+		return;
+	}
+	if (x0 == x1)
+	{
+		draw_vline(x0, y0, y1, line_color);
+		return;
+	}
+
+	bool is_steep = abs(y1 - y0) > abs(x1 - x0);
+
+	if (is_steep)
+	{
+		swap(&x0, &y0);
+		swap(&x1, &y1);
+	}
+
+	if (x0 > x1)
+	{
+		swap(&x0, &x1);
+		swap(&y0, &y1);
+	}
+
+	int deltaX = x1 - x0;
+	int deltaY = abs(y1 - y0);
+	int error = -1 * (deltaX / 2);
+	int y = y0;
+	int y_step = 0;
+
+	if (y0 < y1)
+	{
+		y_step = 1;
+	}
+	else
+	{
+		y_step = -1;
+	}
+
+	// Lines that leave the screen are drawn through the clipped plot_pixel
+	bool on_screen = is_steep
+						 ? (x0 >= 0 && x1 < SCREEN_HEIGHT && y0 >= 0 && y0 < SCREEN_WIDTH && y1 >= 0 && y1 < SCREEN_WIDTH)
+						 : (x0 >= 0 && x1 < SCREEN_WIDTH && y0 >= 0 && y0 < SCREEN_HEIGHT && y1 >= 0 && y1 < SCREEN_HEIGHT);
+
+	if (!on_screen)
+	{
+		for (int x = x0; x <= x1; x++)
+		{
+			if (is_steep)
+			{
+				plot_pixel(y, x, line_color);
+			}
+			else
+			{
+				plot_pixel(x, y, line_color);
+			}
+
+			error = error + deltaY;
+
+			if (error > 0)
+			{
+				y = y + y_step;
+				error = error - deltaX;
+			}
+		}
+		return;
+	}
+
+	// Step the pixel pointer instead of recomputing the address every pixel
+	int major_step = is_steep ? 512 : 1;
+	int minor_step = is_steep ? y_step : y_step * 512;
+	volatile short int *pixel = is_steep ? pixel_buffer_start + (x0 << 9) + y0
+										 : pixel_buffer_start + (y0 << 9) + x0;
+
+	for (int x = x0; x <= x1; x++)
+	{
+		*pixel = line_color;
+		pixel += major_step;
+
+		error = error + deltaY;
+
+		if (error > 0)
+		{
+			pixel += minor_step;
+			error = error - deltaX;
+		}
+	}
+}
+
+void draw_cursor(int x, int y)
+{
+	int cursor_colour;
+
+	if (cursor_toggle == 0)
+	{
+		cursor_colour = 0x000;
+	}
+	else
+	{
+		cursor_colour = 0xFFFF;
+	}
+
+	fill_rect(x, y, x + 3, y + 10, cursor_colour);
+}
+
+void draw_typing_border()
+{
+	fill_rect(0, 216, 319, 217, 0xFFFF);
+}
+
+void draw_logged_in_border()
+{
+	fill_rect(0, 20, 319, 21, 0xFFFF);
+}
+
+void write_char(int x, int y, char c)
+{
+	if (c == 0x10 || c == 0x08)
+	{
+		return;
+	}
+	if (x < 0 || x >= CHAR_COLUMNS || y < 0 || y >= CHAR_ROWS)
+	{
+		return;
+	}
+
+	char *cell = (char *)char_shadow[y] + x;
+	if (*cell != c)
+	{
+		*cell = c;
+		char_row_dirty[y] = true;
+	}
+}
+
+void clear_characters()
+{
+	// Character buffer x length is 80
+	// 					y length is 60
+	clear_character_rows(0, CHAR_ROWS - 1);
+}
+
+void flush_characters()
+{
+	int cells = 0;
+
+	for (int y = 0; y < CHAR_ROWS; y++)
+	{
+		if (!char_row_dirty[y])
+		{
+			continue;
+		}
+		char_row_dirty[y] = false;
+
+		volatile unsigned int *row = (volatile unsigned int *)(character_buffer_start + (y << 7));
+		for (int i = 0; i < CHAR_COLUMNS / 4; i++)
+		{
+			if (char_shadow[y][i] != char_screen[y][i])
+			{
+				row[i] = char_shadow[y][i];
+				char_screen[y][i] = char_shadow[y][i];
+				cells += 4;
+			}
+		}
+	}
+
+	stats.last_frame_cells = cells;
+	stats.total_cells += cells;
+}
+
+void write_word(int x, int y, char *word)
+{
+	while (*word)
+	{
+		write_char(x, y, *word);
+		x++;
+		word++;
+	}
+}
+
+void write_span(int x, int y, const char *text, int length)
+{
+	// Copies a run of characters straight into the shadow row
+	if (y < 0 || y >= CHAR_ROWS || x < 0 || x >= CHAR_COLUMNS || length <= 0)
+	{
+		return;
+	}
+	if (length > CHAR_COLUMNS - x)
+	{
+		length = CHAR_COLUMNS - x;
+	}
+	memcpy((char *)char_shadow[y] + x, text, length);
+	char_row_dirty[y] = true;
+}
+
+const unsigned int *glyph_rows(char c, short int fg, short int bg)
+{
+	if (c < ' ' || c > '~')
+	{
+		c = ' ';
+	}
+	int slot = (c * 7 + fg * 3 + bg) & GLYPH_CACHE_MASK;
+	if (glyph_char[slot] != c || glyph_fg[slot] != (unsigned short)fg || glyph_bg[slot] != (unsigned short)bg)
+	{
+		// Miss: rasterize into the slot, replacing whatever was there
+		unsigned int bits = font3x5[c - ' '];
+		for (int row = 0; row < GLYPH_HEIGHT; row++)
+		{
+			unsigned short pixels[GLYPH_WIDTH];
+			for (int x = 0; x < GLYPH_WIDTH; x++)
+			{
+				bool on = x < 3 && (bits >> (14 - row * 3 - x)) & 1;
+				pixels[x] = on ? fg : bg;
+			}
+			glyph_cache[slot][row][0] = pixels[0] | (pixels[1] << 16);
+			glyph_cache[slot][row][1] = pixels[2] | (pixels[3] << 16);
+		}
+		glyph_char[slot] = c;
+		glyph_fg[slot] = fg;
+		glyph_bg[slot] = bg;
+	}
+	return glyph_cache[slot][0];
+}
+
+void draw_glyph(int x, int y, char c, short int fg, short int bg)
+{
+	// x must be a multiple of GLYPH_WIDTH, so each row is two aligned words
+	if (x < 0 || x > SCREEN_WIDTH - GLYPH_WIDTH)
+	{
+		return;
+	}
+	const unsigned int *rows = glyph_rows(c, fg, bg);
+	for (int row = 0; row < GLYPH_HEIGHT; row++, rows += 2)
+	{
+		if (y + row < 0 || y + row >= SCREEN_HEIGHT)
+		{
+			continue;
+		}
+		volatile unsigned int *dest = (volatile unsigned int *)(pixel_buffer_start + ((y + row) << 9) + x);
+		dest[0] = rows[0];
+		dest[1] = rows[1];
+	}
+}
+
+void draw_glyph_pixels(int x, int y, char c, short int fg, short int bg)
+{
+	// The same glyph one plot_pixel at a time, for benchmark_glyphs()
+	if (c < ' ' || c > '~')
+	{
+		c = ' ';
+	}
+	unsigned int bits = font3x5[c - ' '];
+	for (int row = 0; row < GLYPH_HEIGHT; row++)
+	{
+		for (int col = 0; col < GLYPH_WIDTH; col++)
+		{
+			bool on = col < 3 && (bits >> (14 - row * 3 - col)) & 1;
+			plot_pixel(x + col, y + row, on ? fg : bg);
+		}
+	}
+}
+
+void draw_text(int column, int y, const char *text, int length, short int fg, short int bg)
+{
+	for (int i = 0; i < length && column + i < CHAR_COLUMNS; i++)
+	{
+		draw_glyph((column + i) * GLYPH_WIDTH, y, text[i], fg, bg);
+	}
+}
+
+void benchmark_glyphs()
+{
+	// Glyphs per second through the cache, drawn pixel by pixel, and written
+	// to the character buffer as the old code did for names and the input
+	// line. The character buffer is cheaper still; the pixel font is there
+	// for the colours.
+	char text[] = "The quick brown fox jumps over the lazy dog 0123456789";
+	int length = strlen(text);
+	int rounds = 2000;
+
+	unsigned int start = read_cycles();
+	for (int r = 0; r < rounds; r++)
+	{
+		draw_text(1, 30 + (r & 31) * 6, text, length, sender_colours[r & 7], 0x0000);
+	}
+	unsigned int cached = read_cycles() - start;
+
+	start = read_cycles();
+	for (int r = 0; r < rounds; r++)
+	{
+		for (int i = 0; i < length; i++)
+		{
+			draw_glyph_pixels((1 + i) * GLYPH_WIDTH, 30 + (r & 31) * 6, text[i], sender_colours[r & 7], 0x0000);
+		}
+	}
+	unsigned int naive = read_cycles() - start;
+
+	start = read_cycles();
+	for (int r = 0; r < rounds; r++)
+	{
+		for (int i = 0; i < length; i++)
+		{
+			character_buffer_start[((7 + (r & 31)) << 7) + 1 + i] = text[i];
+		}
+	}
+	unsigned int characters = read_cycles() - start;
+
+	unsigned int glyphs = rounds * length;
+	printf("glyph cache: %u cycles per glyph, %u glyphs/s\n", cached / glyphs,
+		   (unsigned int)((unsigned long long)glyphs * CPU_MHZ * 1000000 / cached));
+	printf("plot_pixel: %u cycles per glyph, %u glyphs/s\n", naive / glyphs,
+		   (unsigned int)((unsigned long long)glyphs * CPU_MHZ * 1000000 / naive));
+	printf("character buffer: %u cycles per glyph, %u glyphs/s\n", characters / glyphs,
+		   (unsigned int)((unsigned long long)glyphs * CPU_MHZ * 1000000 / characters));
+	mark_dirty(REGION_ALL);
+
+	// Have the next flush put back the rows written behind the shadow's back
+	for (int y = 7; y < 7 + 32; y++)
+	{
+		memset(char_screen[y], 0xFF, sizeof(char_screen[y]));
+		char_row_dirty[y] = true;
+	}
+}
+
+volatile short int *pixel_dma_back_buffer()
+{
+	return (volatile short int *)(unsigned long)IO_READ(pixel_ctrl + 1);
+}
+
+bool pixel_dma_swap_pending()
+{
+	// Status bit S stays set until the swap happens at the next vertical blank
+	return IO_READ(pixel_ctrl + 3) & 0x1;
+}
+
+void pixel_dma_request_swap()
+{
+	IO_WRITE(pixel_ctrl, 1);
+}
+
+void wait_for_vsync()
+{
+	pixel_dma_request_swap();
+	while (pixel_dma_swap_pending())
+	{
+	}
+	pixel_buffer_start = pixel_dma_back_buffer();
+}
+
+void init_frame_buffers()
+{
+	// Put Buffer1 on screen, then draw into Buffer2
+	IO_WRITE(pixel_ctrl + 1, (int)(unsigned long)&Buffer1);
+	wait_for_vsync();
+	IO_WRITE(pixel_ctrl + 1, (int)(unsigned long)&Buffer2);
+	pixel_buffer_start = pixel_dma_back_buffer();
+	character_buffer_start = (volatile char *)(unsigned long)IO_READ(CHARACTER_PTR);
+
+	// Start the character buffer from the same blank state as its shadow
+	for (int y = 0; y < CHAR_ROWS; y++)
+	{
+		volatile unsigned int *row = (volatile unsigned int *)(character_buffer_start + (y << 7));
+		for (int i = 0; i < CHAR_COLUMNS / 4; i++)
+		{
+			row[i] = 0;
+		}
+	}
+}
+
+void init_cycle_counter()
+{
+	// The second interval timer interrupts once per tick, and the cycle count
+	// is the tick count plus how far into the current tick it is
+	IO_WRITE(TIMER2_PTR + 1, 0x8); // Stop
+	IO_WRITE(TIMER2_PTR + 2, (TICK_PERIOD - 1) & 0xFFFF);
+	IO_WRITE(TIMER2_PTR + 3, (TICK_PERIOD - 1) >> 16);
+	IO_WRITE(TIMER2_PTR + 1, 0x7); // Interrupt, continuous, start
+}
+
+unsigned int read_cycles()
+{
+	unsigned int ticks, count;
+	int pending;
+	do
+	{
+		// Writing the snapshot register latches the current count
+		ticks = tick_count;
+		IO_WRITE(TIMER2_PTR + 4, 0);
+		count = (IO_READ(TIMER2_PTR + 5) << 16) | (IO_READ(TIMER2_PTR + 4) & 0xFFFF);
+		pending = IO_READ(TIMER2_PTR) & 0x1;
+	} while (ticks != tick_count); // tick_ISR ran in between
+
+	// A tick that tick_ISR has not counted yet, because interrupts are off.
+	// A count in the lower half means the timeout came after the snapshot.
+	if (pending && count > TICK_PERIOD / 2)
+	{
+		ticks++;
+	}
+	return ticks * TICK_PERIOD + (TICK_PERIOD - 1 - count);
+}
+
+void clear_pixel_rows(int y0, int y1)
+{
+	fill_rect(0, y0, SCREEN_WIDTH - 1, y1, 0x0000);
+}
+
+void clear_character_rows(int y0, int y1)
+{
+	for (int y = y0; y <= y1; y++)
+	{
+		for (int i = 0; i < CHAR_COLUMNS / 4; i++)
+		{
+			if (char_shadow[y][i] != 0)
+			{
+				char_shadow[y][i] = 0;
+				char_row_dirty[y] = true;
+			}
+		}
+	}
+}
+
+void mark_dirty(int regions)
+{
+	dirty_regions |= regions;
+}
+
+void redraw_dirty()
+{
+	// At most one frame per refresh: the back buffer is still on screen until
+	// the previous swap completes
+	if (dirty_regions == 0 || pixel_dma_swap_pending())
+	{
+		return;
+	}
+
+	unsigned int start = read_cycles();
+	pixel_buffer_start = pixel_dma_back_buffer();
+
+	// The back buffer also lacks whatever was drawn into the other buffer
+	int regions = dirty_regions | prev_frame_regions;
+	prev_frame_regions = dirty_regions;
+
+	if (regions & REGION_HEADER)
+	{
+		clear_pixel_rows(0, 21);
+		clear_character_rows(0, 4);
+		draw_logged_in_border();
+		whos_logged_in();
+	}
+	if (regions & (REGION_HEADER | REGION_HUD))
+	{
+		clear_character_rows(3, 4);
+		if (hud_visible)
+		{
+			draw_hud();
+		}
+	}
+	if (regions & REGION_MESSAGES)
+	{
+		clear_pixel_rows(22, 215);
+		clear_character_rows(5, 53);
+		printMessages();
+	}
+	if (regions & (REGION_MESSAGES | REGION_PREVIEW))
+	{
+		clear_character_rows(PREVIEW_ROW, PREVIEW_ROW);
+		draw_preview();
+	}
+	if (regions & REGION_INPUT)
+	{
+		clear_pixel_rows(216, 239);
+		clear_character_rows(54, 59);
+		draw_typing_border();
+		if (search_active)
+		{
+			draw_search_line();
+		}
+		else
+		{
+			draw_input_line();
+		}
+	}
+
+	dirty_regions = 0;
+	flush_characters();
+	pixel_dma_request_swap();
+#if PROFILE
+	if (key_waiting)
+	{
+		// The keys drawn now are timed to this swap. A previous swap that is
+		// done but not yet seen by tick_ISR is recorded first.
+		NIOS2_WRITE_STATUS(0);
+		if (key_swap_waiting)
+		{
+			profile_record(HIST_KEY_TO_SCREEN, read_cycles() - key_swap_cycles);
+		}
+		key_swap_cycles = key_cycles;
+		key_swap_waiting = true;
+		NIOS2_WRITE_STATUS(1);
+		key_waiting = false;
+	}
+#endif
+
+	unsigned int elapsed = read_cycles() - start;
+	PROFILE_RECORD(HIST_FRAME, elapsed);
+	stats.frames_drawn++;
+	stats.last_frame_cycles = elapsed;
+	if (elapsed > stats.max_frame_cycles)
+	{
+		stats.max_frame_cycles = elapsed;
+	}
+}
+
+void initial_setup()
+{
+	while (pixel_dma_swap_pending())
+	{
+	}
+	mark_dirty(REGION_ALL);
+	prev_frame_regions = REGION_ALL;
+	redraw_dirty();
+}
+
+void clean_display()
+{
+	// Clear both pixel buffers
+	clear_screen();
+	wait_for_vsync();
+	clear_screen();
+	clear_characters();
+	flush_characters();
+}
+
+void enter_name()
+{
+	clean_display();
+	write_word(25, 30, "Enter Your Name:");
+
+	// Loop until enter is pressed, composing one frame per refresh. Keys are
+	// taken one at a time and none after that Enter, so a line typed straight
+	// after the name stays in kb_ring for the chat.
+	while (last_pressed != KEY_ENTER || buffer_index == 0)
+	{
+		while (kb_tail != kb_head && (last_pressed != KEY_ENTER || buffer_index == 0))
+		{
+			process_next_key();
+		}
+
+		// The shadow grid only flushes the cells that actually changed
+		clear_character_rows(30, 30);
+		write_word(25, 30, "Enter Your Name:");
+		write_word(43, 30, buffer);
+		flush_characters();
+
+		cursor_toggle = 1;
+		clear_pixel_rows(cursor_y, cursor_y + 10);
+		draw_cursor(cursor_x + 4 * edit_pos, cursor_y);
+		wait_for_vsync();
+	}
+
+	last_pressed = -1;
+	strcpy(my_user_name, buffer);
+	memset(buffer, 0, BUFFER_SIZE);
+	buffer_index = 0;
+	edit_pos = 0;
+#if PROFILE
+	key_waiting = false; // Name entry draws on its own, so its keys are not timed
+#endif
+	stats.name_ticks = tick_count;
+	link_start(); // The first hello goes out with the next tick
+}
+
+void whos_logged_in()
+{
+	char logged_in_text[256] = "Logged in as ";
+	char talking_to_text[256] = "Talking to ";
+
+	// Concatinating user names to display messages for VGA
+	strcat(logged_in_text, my_user_name);
+	strcat(talking_to_text, (char *)connected_user_name);
+	if (!conn)
+	{
+		strcat(talking_to_text, " (no link)");
+	}
+
+	write_word(2, 2, talking_to_text);
+	write_word(45, 2, logged_in_text);
+}
+
+void test_messages()
+{
+	insertMessage("Agrim", "hi", 2);
+	insertMessage("balls", "balls", 5);
+	insertMessage("lol", "lol", 3);
+	insertMessage("balls", "lol", 3);
+	for (int i = 4; i <= 30; i++)
+	{
+		insertMessage("balls", "balls", 5);
+	}
+	printMessages();
+
+	// write_word(2, 49, "Connection One >> Message One");
+	// write_word(2, 51, "Connection Two >> Message Two");
+}
+
+void benchmark_primitives()
+{
+	// Old path: column-major clear through plot_pixel
+	unsigned int start = read_cycles();
+	for (int x = 0; x < SCREEN_WIDTH; x++)
+	{
+		for (int y = 0; y < SCREEN_HEIGHT; y++)
+		{
+			plot_pixel(x, y, 0x0000);
+		}
+	}
+	unsigned int per_pixel_clear = read_cycles() - start;
+
+	start = read_cycles();
+	clear_screen();
+	unsigned int span_clear = read_cycles() - start;
+
+	// Old path: cursor as four one-pixel-wide Bresenham lines
+	start = read_cycles();
+	for (int i = 0; i < 100; i++)
+	{
+		for (int x = 0; x < 4; x++)
+		{
+			for (int y = 224; y <= 234; y++)
+			{
+				plot_pixel(64 + x, y, 0xFFFF);
+			}
+		}
+	}
+	unsigned int per_pixel_cursor = read_cycles() - start;
+
+	start = read_cycles();
+	for (int i = 0; i < 100; i++)
+	{
+		draw_cursor(64, 224);
+	}
+	unsigned int rect_cursor = read_cycles() - start;
+
+	printf("clear: per-pixel path %u cycles, span %u cycles\n", per_pixel_clear, span_clear);
+	printf("100 cursors: per-pixel path %u cycles, rect %u cycles\n", per_pixel_cursor, rect_cursor);
+}
+
+void benchmark_packing()
+{
+	char text[] = "Hello, are you there? The demo starts at 3, meet me in the lab.";
+	int length = strlen(text);
+	char packed[FRAME_MAX_PAYLOAD];
+	char unpacked[FRAME_MAX_PAYLOAD];
+	int packed_length = 0;
+
+	unsigned int start = read_cycles();
+	for (int i = 0; i < 100; i++)
+	{
+		packed_length = pack6_encode(text, length, packed, FRAME_MAX_PAYLOAD);
+	}
+	unsigned int encode_cycles = read_cycles() - start;
+
+	start = read_cycles();
+	for (int i = 0; i < 100; i++)
+	{
+		pack6_decode(packed, packed_length, unpacked, FRAME_MAX_PAYLOAD);
+	}
+	unsigned int decode_cycles = read_cycles() - start;
+
+	// Raw mode is a plain copy into the frame
+	start = read_cycles();
+	for (int i = 0; i < 100; i++)
+	{
+		memcpy(unpacked, text, length);
+	}
+	unsigned int raw_cycles = read_cycles() - start;
+
+	printf("bytes on wire: %d raw, %d packed\n", length + FRAME_OVERHEAD, packed_length + FRAME_OVERHEAD);
+	printf("100 messages: %u cycles raw, %u encode, %u decode\n", raw_cycles, encode_cycles, decode_cycles);
+}
+
+bool benchmark_link(int count, int size)
+{
+	// Run on both boards at once: each sends count numbered messages and
+	// checks that the peer's arrive exactly once and in order. A size pads
+	// each message to that many bytes that do not pack.
+	char out[FRAME_MAX_PAYLOAD + 1];
+	char in[FRAME_MAX_PAYLOAD + 1];
+	struct Frame frame;
+	frame.payload = in;
+	int sent = 0;
+	int received = 0;
+	int misordered = 0;
+	unsigned int received_bytes = 0;
+
+	// Connect the way the chat does, then time the transfer alone
+	unsigned int start = tick_count;
+	link_start();
+	while (!conn)
+	{
+		rx_pop_frame(&frame);
+		handle_link_event();
+	}
+	printf("link: connected in %u ms\n", (tick_count - start) * 1000 / TICKS_PER_SECOND);
+	start = tick_count;
+
+	while (sent < count || received < count || tx_base != tx_seq)
+	{
+		if (sent < count && (unsigned char)(tx_seq - tx_base) < TX_SLOTS)
+		{
+			int length = snprintf(out, sizeof(out), "%d the quick brown fox jumps over the lazy dog", sent);
+			for (; length < size && length < FRAME_MAX_PAYLOAD; length++)
+			{
+				out[length] = 0x80 | length;
+			}
+			send_frame(FRAME_MESSAGE, out, length);
+			sent++;
+		}
+		while (rx_pop_frame(&frame))
+		{
+			RX_DELAY();
+			if (frame.type == FRAME_MESSAGE)
+			{
+				misordered += atoi(in) != received;
+				received++;
+				received_bytes += frame.length;
+			}
+		}
+		handle_retransmit_event();
+		handle_link_event();
+	}
+	unsigned int elapsed = tick_count - start;
+
+	// Keep answering until the peer has surely seen our last ACK
+	for (start = tick_count; tick_count - start < 2 * RETRANSMIT_MAX_TICKS;)
+	{
+		rx_pop_frame(&frame);
+		handle_link_event();
+	}
+
+	printf("link: %d messages each way, %d out of order, %u resent, %u duplicates, %u gaps\n", count, misordered,
+		   stats.tx_retransmits, stats.rx_duplicates, stats.rx_seq_gaps);
+	printf("link: %u ms, goodput %u B/s, %u bytes dropped, %u acknowledges held back\n",
+		   elapsed * 1000 / TICKS_PER_SECOND, elapsed ? received_bytes * TICKS_PER_SECOND / elapsed : 0,
+		   stats.rx_dropped_bytes, stats.rx_ack_stalls);
+	return misordered == 0 && stats.rx_dropped_bytes == 0;
+}
+
+void detect_connection()
+{
+	clean_display();
+
+	write_word(25, 30, "Waiting for a connection...");
+	flush_characters();
+
+	// Hellos go out from the tick, so this only has to wait for the answer.
+	// Keys are taken as in the chat, so lines typed meanwhile wait in the
+	// send queue and show once the chat screen is up.
+	while (!conn)
+	{
+		switch (wait_for_event())
+		{
+		case EVENT_KEY:
+			handle_key_event();
+			break;
+		case EVENT_RX:
+			handle_rx_event();
+			break;
+		case EVENT_LINK:
+			handle_link_event();
+			break;
+		}
+	}
+}
+
+int intern_sender(const char *name)
+{
+	for (int i = 0; i < sender_count; i++)
+	{
+		if (strncmp(sender_names[i], name, SENDER_NAME_SIZE - 1) == 0)
+		{
+			return i;
+		}
+	}
+
+	// Once the table is full, a slot is only reused when no live record
+	// uses it, evicting the oldest messages until one is free
+	int index = sender_count < MAX_SENDERS ? sender_count++ : -1;
+	while (index < 0)
+	{
+		for (int i = 0; i < MAX_SENDERS && index < 0; i++)
+		{
+			if (sender_refs[i] == 0)
+			{
+				index = i;
+			}
+		}
+		if (index < 0)
+		{
+			evict_oldest_message();
+		}
+	}
+	strncpy(sender_names[index], name, SENDER_NAME_SIZE - 1);
+	sender_names[index][SENDER_NAME_SIZE - 1] = 0;
+	int shown = strlen(sender_names[index]);
+	sender_shown[index] = shown < SENDER_SHOWN ? shown : SENDER_SHOWN;
+	return index;
+}
+
+struct MessageRecord *get_message(unsigned int id)
+{
+	return (struct MessageRecord *)(arena + message_offset[id & MESSAGE_INDEX_MASK]);
+}
+
+void evict_oldest_message()
+{
+	struct MessageRecord *oldest = (struct MessageRecord *)(arena + arena_head);
+	if (!(oldest->flags & RECORD_PAD))
+	{
+		sender_refs[oldest->sender]--;
+		first_message_id++;
+		stats.messages_evicted++;
+	}
+	arena_used -= oldest->size;
+	arena_head += oldest->size;
+	if (arena_head == ARENA_SIZE)
+	{
+		arena_head = 0;
+	}
+}
+
+char *message_reserve()
+{
+	// Makes room for the largest record at arena_tail and returns where its
+	// text goes, so a message can be written in place before it is committed
+	unsigned int start = read_cycles();
+
+	if (arena_used == 0)
+	{
+		arena_head = arena_tail = 0;
+	}
+
+	if (ARENA_SIZE - arena_tail < RECORD_MAX_SIZE)
+	{
+		// Pad out the end of the arena so the record stays contiguous
+		unsigned int pad = ARENA_SIZE - arena_tail;
+		while (ARENA_SIZE - arena_used < pad)
+		{
+			evict_oldest_message();
+		}
+		struct MessageRecord *padding = (struct MessageRecord *)(arena + arena_tail);
+		padding->size = pad;
+		padding->flags = RECORD_PAD;
+		arena_used += pad;
+		arena_tail = 0;
+	}
+
+	// The index must also have room for the message's postings
+	while (ARENA_SIZE - arena_used < RECORD_MAX_SIZE || next_message_id - first_message_id >= MESSAGE_INDEX_SIZE ||
+		   (next_message_id != first_message_id &&
+			posting_head - posting_start[first_message_id & MESSAGE_INDEX_MASK] > POSTING_POOL_SIZE - MAX_MESSAGE_POSTINGS))
+	{
+		evict_oldest_message();
+	}
+
+	stats.store_cycles += read_cycles() - start;
+	return ((struct MessageRecord *)(arena + arena_tail))->text;
+}
+
+void message_commit(int sender, int length)
+{
+	// Turns the text written after message_reserve() into a record
+	unsigned int start = read_cycles();
+
+	struct MessageRecord *record = (struct MessageRecord *)(arena + arena_tail);
+	record->sender = sender;
+	sender_refs[sender]++;
+	record->flags = 0;
+	record->id = next_message_id;
+	record->length = length;
+	record->text[length] = 0;
+	int lines = layout_message(record);
+	record->size = (RECORD_HEADER_SIZE + length + 1 + lines * sizeof(struct MessageLine) + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+	index_message(record);
+
+	message_offset[next_message_id & MESSAGE_INDEX_MASK] = arena_tail;
+	message_row[next_message_id & MESSAGE_INDEX_MASK] = total_rows;
+	next_message_id++;
+
+	// A separator row and the wrapped text. Keep a scrolled-back view still.
+	total_rows += 1 + lines;
+	if (scroll_offset > 0)
+	{
+		scroll_offset += 1 + lines;
+	}
+
+	arena_used += record->size;
+	arena_tail += record->size;
+	if (arena_tail == ARENA_SIZE)
+	{
+		arena_tail = 0;
+	}
+
+	stats.messages_stored++;
+	stats.store_cycles += read_cycles() - start;
+}
+
+struct MessageLine *message_lines(struct MessageRecord *m)
+{
+	return (struct MessageLine *)(m->text + m->length + 1);
+}
+
+int layout_message(struct MessageRecord *m)
+{
+	// Greedy word wrap, done once when the message is stored. The first line
+	// follows the "name >> " prefix, later ones are indented.
+	struct MessageLine *lines = message_lines(m);
+	int width = TEXT_WIDTH - sender_shown[m->sender] - 4;
+	int count = 0;
+	int pos = 0;
+
+	do
+	{
+		int length = m->length - pos;
+		if (length > width)
+		{
+			// Break at the last space that fits, or mid-word if there is none
+			length = width;
+			for (int i = width; i > 0; i--)
+			{
+				if (m->text[pos + i] == ' ')
+				{
+					length = i;
+					break;
+				}
+			}
+		}
+		if (count == MAX_MESSAGE_LINES - 1)
+		{
+			length = m->length - pos; // Cannot happen with FRAME_MAX_PAYLOAD, write_span clips
+		}
+
+		lines[count].start = pos;
+		lines[count].length = length;
+		count++;
+
+		pos += length;
+		while (pos < m->length && m->text[pos] == ' ')
+		{
+			pos++;
+		}
+		width = TEXT_WIDTH - WRAP_INDENT;
+	} while (pos < m->length);
+
+	m->line_count = count;
+	return count;
+}
+
+void insertMessage(const char *sender, const char *text, int length)
+{
+	if (length > FRAME_MAX_PAYLOAD)
+	{
+		length = FRAME_MAX_PAYLOAD;
+	}
+	char *slot = message_reserve();
+	memcpy(slot, text, length);
+	message_commit(intern_sender(sender), length);
+}
+
+void init_search_index(void)
+{
+	memset(trigram_newest, 0xFF, sizeof(trigram_newest)); // POSTING_NONE
+}
+
+char fold_case(char c)
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+int trigram_hash(const char *text)
+{
+	return (fold_case(text[0]) * 961 + fold_case(text[1]) * 31 + fold_case(text[2])) & TRIGRAM_MASK;
+}
+
+void index_message(struct MessageRecord *m)
+{
+	unsigned int start = read_cycles();
+	posting_start[m->id & MESSAGE_INDEX_MASK] = posting_head;
+	for (int i = 0; i + 3 <= m->length; i++)
+	{
+		int trigram = trigram_hash(m->text + i);
+		unsigned int newest = trigram_newest[trigram];
+		if (newest != POSTING_NONE && postings[newest].id == m->id && postings[newest].trigram == trigram)
+		{
+			continue; // Already listed for this message
+		}
+
+		struct Posting *posting = &postings[posting_head & POSTING_MASK];
+		posting->id = m->id;
+		posting->trigram = trigram;
+		posting->next = newest;
+		trigram_newest[trigram] = posting_head & POSTING_MASK;
+		posting_head++;
+	}
+	stats.index_cycles += read_cycles() - start;
+}
+
+int posting_follow(unsigned int index, int trigram, unsigned int newer_id)
+{
+	// Returns index, or -1 if the chain ends there: the slot has been reused
+	// or names a message that has been evicted
+	if (index == POSTING_NONE)
+	{
+		return -1;
+	}
+	struct Posting *posting = &postings[index];
+	if (posting->trigram != trigram || posting->id >= newer_id || posting->id < first_message_id)
+	{
+		return -1;
+	}
+	return index;
+}
+
+bool message_contains(struct MessageRecord *m, const char *query, int length)
+{
+	for (int i = 0; i + length <= m->length; i++)
+	{
+		int j = 0;
+		while (j < length && fold_case(m->text[i + j]) == fold_case(query[j]))
+		{
+			j++;
+		}
+		if (j == length)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+int search_messages(const char *query, int length, unsigned int *results, int max)
+{
+	// Fills results with matching message ids, newest first. Candidates are
+	// the messages on every one of the query's trigram chains, checked against
+	// the text to rule out hash collisions.
+	int count = 0;
+	if (length < 3)
+	{
+		// Too short for a trigram, so look through the whole store
+		for (unsigned int id = next_message_id; id != first_message_id && count < max;)
+		{
+			id--;
+			if (message_contains(get_message(id), query, length))
+			{
+				results[count++] = id;
+			}
+		}
+		return count;
+	}
+
+	int chains = length - 2;
+	int trigram[SEARCH_MAX_LENGTH];
+	int at[SEARCH_MAX_LENGTH];
+	for (int i = 0; i < chains; i++)
+	{
+		trigram[i] = trigram_hash(query + i);
+		at[i] = posting_follow(trigram_newest[trigram[i]], trigram[i], next_message_id);
+	}
+
+	while (count < max)
+	{
+		// No message newer than the lowest id any chain is at can be on all of them
+		unsigned int target = next_message_id;
+		for (int i = 0; i < chains; i++)
+		{
+			if (at[i] < 0)
+			{
+				return count;
+			}
+			if (postings[at[i]].id < target)
+			{
+				target = postings[at[i]].id;
+			}
+		}
+
+		bool on_all = true;
+		for (int i = 0; i < chains; i++)
+		{
+			while (at[i] >= 0 && postings[at[i]].id > target)
+			{
+				at[i] = posting_follow(postings[at[i]].next, trigram[i], postings[at[i]].id);
+			}
+			on_all = on_all && at[i] >= 0 && postings[at[i]].id == target;
+		}
+		if (!on_all)
+		{
+			continue;
+		}
+
+		if (message_contains(get_message(target), query, length))
+		{
+			results[count++] = target;
+		}
+		for (int i = 0; i < chains; i++)
+		{
+			at[i] = posting_follow(postings[at[i]].next, trigram[i], target);
+		}
+	}
+	return count;
+}
+
+void log_reset(void)
+{
+	struct LogHeader *header = (struct LogHeader *)LOG_AREA;
+	header->end = sizeof(struct LogHeader);
+	header->wrap_end = 0;
+	header->magic = LOG_MAGIC;
+	log_next_seq = 0;
+}
+
+unsigned short log_record_crc(struct LogRecord *record)
+{
+	unsigned short crc = 0xFFFF;
+	for (int i = 0; i < 4; i++)
+	{
+		crc = crc16_update(crc, record->seq >> (i * 8));
+	}
+	crc = crc16_update(crc, record->name_length);
+	crc = crc16_update(crc, record->text_length);
+	for (int i = 0; i < record->name_length + record->text_length; i++)
+	{
+		crc = crc16_update(crc, record->data[i]);
+	}
+	return crc;
+}
+
+void log_append(struct MessageRecord *m)
+{
+	struct LogHeader *header = (struct LogHeader *)LOG_AREA;
+	const char *name = sender_names[m->sender];
+	int name_length = strlen(name);
+	unsigned int size = (sizeof(struct LogRecord) + name_length + m->length + 4 + 3) & ~3;
+
+	unsigned int offset = header->end;
+	if (LOG_SIZE - offset < size)
+	{
+		header->wrap_end = offset;
+		offset = sizeof(struct LogHeader);
+	}
+
+	struct LogRecord *record = (struct LogRecord *)(LOG_AREA + offset);
+	record->magic = LOG_RECORD_MAGIC;
+	record->size = size;
+	record->seq = log_next_seq++;
+	record->name_length = name_length;
+	record->text_length = m->length;
+	memcpy(record->data, name, name_length);
+	memcpy(record->data + name_length, m->text, m->length);
+	*(unsigned int *)(LOG_AREA + offset + size - 4) = size;
+	record->crc = log_record_crc(record);
+
+	// The record must be in SDRAM before the header counts it
+	__sync_synchronize();
+	header->end = offset + size;
+}
+
+int log_restore(void)
+{
+	// Rebuilds only the messages that fill the view, from the newest records,
+	// so startup takes the same time however long the log is
+	unsigned int start = read_cycles();
+	struct LogHeader *header = (struct LogHeader *)LOG_AREA;
+	if (header->magic != LOG_MAGIC || header->end < sizeof(struct LogHeader) || header->end > LOG_SIZE ||
+		header->wrap_end > LOG_SIZE)
+	{
+		log_reset();
+		return 0;
+	}
+
+	struct LogRecord *found[LOG_RESTORE_MESSAGES];
+	int count = 0;
+	unsigned int end = header->end;
+	bool wrapped = false;
+	while (count < LOG_RESTORE_MESSAGES)
+	{
+		if (end == sizeof(struct LogHeader))
+		{
+			// Carry on from the records left at the back when the log wrapped
+			if (wrapped || header->wrap_end <= header->end)
+			{
+				break;
+			}
+			end = header->wrap_end;
+			wrapped = true;
+		}
+
+		unsigned int size = *(unsigned int *)(LOG_AREA + end - 4);
+		if (size < sizeof(struct LogRecord) + 4 || (size & 3) || size > end - sizeof(struct LogHeader))
+		{
+			break;
+		}
+		struct LogRecord *record = (struct LogRecord *)(LOG_AREA + end - size);
+		if (record->magic != LOG_RECORD_MAGIC || record->size != size)
+		{
+			break;
+		}
+		end -= size;
+
+		// A torn or damaged record is skipped, but the sequence numbers must
+		// keep going down or the walk has reached records overwritten by newer ones
+		if (sizeof(struct LogRecord) + record->name_length + record->text_length + 4 > size ||
+			record->crc != log_record_crc(record))
+		{
+			stats.log_skipped++;
+			continue;
+		}
+		if (count > 0 && record->seq >= found[count - 1]->seq)
+		{
+			break;
+		}
+		found[count++] = record;
+	}
+
+	log_next_seq = count > 0 ? found[0]->seq + 1 : 0;
+	for (int i = count - 1; i >= 0; i--)
+	{
+		char name[SENDER_NAME_SIZE];
+		int name_length = found[i]->name_length < SENDER_NAME_SIZE ? found[i]->name_length : SENDER_NAME_SIZE - 1;
+		memcpy(name, found[i]->data, name_length);
+		name[name_length] = 0;
+
+		char *slot = message_reserve();
+		memcpy(slot, found[i]->data + found[i]->name_length, found[i]->text_length);
+		message_commit(intern_sender(name), found[i]->text_length);
+	}
+
+	stats.log_restored = count;
+	stats.log_restore_cycles = read_cycles() - start;
+	return count;
+}
+
+void benchmark_log(void)
+{
+	// Restore time as the log grows, in a scratch area so the chat log is
+	// left alone
+	log_area = LOG_SCRATCH;
+	char text[] = "see you at the lab at three, bring the second board and the ribbon cable";
+	insertMessage("balls", text, strlen(text));
+	struct MessageRecord *m = get_message(next_message_id - 1);
+
+	int sizes[4] = {100, 1000, 10000, 30000};
+	for (int i = 0; i < 4; i++)
+	{
+		log_reset();
+		unsigned int start = read_cycles();
+		for (int n = 0; n < sizes[i]; n++)
+		{
+			log_append(m);
+		}
+		unsigned int append_cycles = (read_cycles() - start) / sizes[i];
+
+		log_restore();
+		unsigned int end = ((struct LogHeader *)LOG_AREA)->end;
+		printf("log of %d records (%u bytes used): %u cycles per append, restore %u messages in %u cycles\n", sizes[i],
+			   end, append_cycles, stats.log_restored, stats.log_restore_cycles);
+	}
+	log_area = LOG_HOME;
+	mark_dirty(REGION_MESSAGES);
+}
+
+void benchmark_message_store()
+{
+	char text[] = "see you at the lab at three";
+	int count = 5000;
+
+	unsigned int start = read_cycles();
+	for (int i = 0; i < count; i++)
+	{
+		insertMessage("balls", text, strlen(text));
+	}
+	unsigned int elapsed = read_cycles() - start;
+
+	// The old store kept a static messages[4 * BUFFER_SIZE] array of 516-byte
+	// structs and malloc'd a 520-byte node per message
+	unsigned int old_static = 4 * BUFFER_SIZE * 516;
+	unsigned int old_heap = count * 520;
+	unsigned int arena_total = sizeof(arena) + sizeof(message_offset) + sizeof(sender_names);
+
+	printf("old store: %u bytes static + %u bytes heap, unbounded\n", old_static, old_heap);
+	printf("arena store: %u bytes total, %u messages held\n", arena_total, next_message_id - first_message_id);
+	printf("%d inserts: %u cycles, %u per insert\n", count, elapsed, elapsed / count);
+}
+
+unsigned int find_message_at_row(unsigned int row)
+{
+	// Binary search for the last live message starting at or before row
+	unsigned int low = first_message_id;
+	unsigned int high = next_message_id - 1;
+	while (low != high)
+	{
+		unsigned int mid = low + (high - low + 1) / 2;
+		if (message_row[mid & MESSAGE_INDEX_MASK] <= row)
+		{
+			low = mid;
+		}
+		else
+		{
+			high = mid - 1;
+		}
+	}
+	return low;
+}
+
+void scroll_messages(int rows)
+{
+	// Positive scrolls back into history, clamped to what is still stored
+	unsigned int history = 0;
+	if (next_message_id != first_message_id)
+	{
+		history = total_rows - message_row[first_message_id & MESSAGE_INDEX_MASK];
+	}
+	unsigned int max_offset = history > VIEW_ROWS ? history - VIEW_ROWS : 0;
+
+	int offset = scroll_offset + rows;
+	if (offset < 0)
+	{
+		offset = 0;
+	}
+	if (offset > (int)max_offset)
+	{
+		offset = max_offset;
+	}
+
+	if ((unsigned int)offset != scroll_offset)
+	{
+		scroll_offset = offset;
+		mark_dirty(REGION_MESSAGES);
+	}
+}
+
+void printMessages()
+{
+	// Only the messages overlapping the view are visited
+	if (next_message_id == first_message_id)
+	{
+		return;
+	}
+
+	unsigned int bottom = total_rows - scroll_offset; // One past the last visible row
+	unsigned int top = bottom > VIEW_ROWS ? bottom - VIEW_ROWS : 0;
+	unsigned int id = find_message_at_row(top);
+
+	for (; id != next_message_id; id++)
+	{
+		struct MessageRecord *m = get_message(id);
+		unsigned int row = message_row[id & MESSAGE_INDEX_MASK] + 1; // Text follows the separator
+		for (int line = 0; line < m->line_count; line++, row++)
+		{
+			if (row >= bottom)
+			{
+				return;
+			}
+			if (row >= top)
+			{
+				// The newest visible row goes on the last row of the view
+				show_message_line(m, line, VIEW_TOP_ROW + VIEW_ROWS - (bottom - row));
+			}
+		}
+	}
+}
+
+void show_message_line(struct MessageRecord *m, int line, int row)
+{
+	// Copies one precomputed line of the layout into the character grid
+	struct MessageLine *span = message_lines(m) + line;
+	int x = TEXT_COLUMN + WRAP_INDENT;
+	short int background = 0x0000;
+	if (search_active && search_match[m->id & MESSAGE_INDEX_MASK] == search_generation)
+	{
+		background = SEARCH_HIGHLIGHT;
+		fill_rect(TEXT_COLUMN * 4 - 2, row * 4 - 1, (TEXT_COLUMN + TEXT_WIDTH) * 4 + 1, row * 4 + 3, background);
+	}
+	if (line == 0)
+	{
+		// The name goes in the pixel buffer in the sender's colour, with its
+		// bottom row on the text row's baseline
+		int shown = sender_shown[m->sender];
+		draw_text(TEXT_COLUMN, row * 4 - 1, sender_names[m->sender], shown, sender_colours[m->sender], background);
+		write_span(TEXT_COLUMN + shown, row, " >> ", 4);
+		x = TEXT_COLUMN + shown + 4;
+	}
+	write_span(x, row, m->text + span->start, span->length);
+}
+
+void run_search(void)
+{
+	// Searches again after the query changes, and moves the highlight
+	unsigned int start = read_cycles();
+	search_count = search_active && search_length > 0 ? search_messages(search_query, search_length, search_results, SEARCH_MAX_RESULTS) : 0;
+	stats.search_cycles = read_cycles() - start;
+
+	search_generation++;
+	for (int i = 0; i < search_count; i++)
+	{
+		search_match[search_results[i] & MESSAGE_INDEX_MASK] = search_generation;
+	}
+	search_shown = -1;
+	mark_dirty(REGION_MESSAGES | REGION_INPUT);
+}
+
+void search_key(int key)
+{
+	// Typing edits the query, Enter steps back through the results and Esc
+	// leaves search mode. None of it is a message to send.
+	last_pressed = -1;
+	switch (key)
+	{
+	case KEY_ESC:
+		search_active = false;
+		run_search();
+		break;
+	case KEY_BACKSPACE:
+		if (search_length > 0)
+		{
+			search_query[--search_length] = 0;
+			run_search();
+		}
+		break;
+	case KEY_ENTER:
+		if (search_count > 0)
+		{
+			search_shown = (search_shown + 1) % search_count;
+			scroll_to_message(search_results[search_shown]);
+			mark_dirty(REGION_INPUT);
+		}
+		break;
+	default:
+		if (key >= ' ' && key < 0x7F && search_length < SEARCH_MAX_LENGTH)
+		{
+			search_query[search_length++] = key;
+			search_query[search_length] = 0;
+			run_search();
+		}
+		break;
+	}
+}
+
+void scroll_to_message(unsigned int id)
+{
+	// Puts the message in the middle of the view where the history allows
+	struct MessageRecord *m = get_message(id);
+	unsigned int bottom = message_row[id & MESSAGE_INDEX_MASK] + 1 + m->line_count + VIEW_ROWS / 2;
+	unsigned int offset = bottom < total_rows ? total_rows - bottom : 0;
+	scroll_messages((int)offset - (int)scroll_offset);
+}
+
+void draw_input_line(void)
+{
+	write_word(2, 57, stream_typing ? "Live Message: " : "Enter Message:");
+
+	// The text being typed is drawn in pixels on a highlighted band, with
+	// the character under the cursor inverted
+	int length = strlen(buffer);
+	int caret = cursor_x + 4 * (edit_pos + 1);
+	fill_rect(17 * GLYPH_WIDTH - 2, cursor_y, SCREEN_WIDTH - 3, cursor_y + 10, INPUT_HIGHLIGHT);
+	draw_text(17, cursor_y + 3, buffer, length, 0xFFFF, INPUT_HIGHLIGHT);
+	if (cursor_toggle)
+	{
+		draw_cursor(caret, cursor_y);
+		if (edit_pos < length)
+		{
+			draw_glyph(caret, cursor_y + 3, buffer[edit_pos], INPUT_HIGHLIGHT, 0xFFFF);
+		}
+	}
+}
+
+void draw_search_line(void)
+{
+	write_word(2, 57, "Search:");
+	fill_rect(17 * GLYPH_WIDTH - 2, cursor_y, SCREEN_WIDTH - 3, cursor_y + 10, SEARCH_HIGHLIGHT);
+	draw_text(17, cursor_y + 3, search_query, search_length, 0xFFFF, SEARCH_HIGHLIGHT);
+	if (cursor_toggle)
+	{
+		draw_cursor(cursor_x + 4 * (search_length + 1), cursor_y);
+	}
+
+	char status[32];
+	if (search_shown >= 0)
+	{
+		snprintf(status, sizeof(status), "%d of %d", search_shown + 1, search_count);
+	}
+	else
+	{
+		snprintf(status, sizeof(status), "%d%s found, %u us", search_count, search_count == SEARCH_MAX_RESULTS ? "+" : "",
+				 stats.search_cycles / CPU_MHZ);
+	}
+	write_word(CHAR_COLUMNS - 2 - strlen(status), 57, status);
+}
+
+void benchmark_search(void)
+{
+	// Query time through the index and by scanning every message, as the
+	// store fills, doubling from 128 to 4096 messages. Eight of the first 256
+	// have the word searched for, so only the history grows.
+	const char *words[8] = {"board", "cable", "lab", "the", "frame", "meet", "at", "three"};
+	unsigned int seed = 1;
+	unsigned int found[SEARCH_MAX_RESULTS];
+
+	// Earlier benchmarks may have stored messages with the word in them
+	while (first_message_id != next_message_id)
+	{
+		evict_oldest_message();
+	}
+
+	for (int added = 0, target = 128; target <= 4096; target *= 2)
+	{
+		for (int n = added; n < target; n++)
+		{
+			char text[FRAME_MAX_PAYLOAD];
+			int length = 0;
+			for (int w = 0; w < 8; w++)
+			{
+				seed = seed * 1103515245 + 12345;
+				length += sprintf(text + length, "%s ", words[(seed >> 16) & 7]);
+			}
+			if (n < 256 && n % 32 == 0)
+			{
+				length += sprintf(text + length, "ribbon");
+			}
+			insertMessage("balls", text, length);
+		}
+		added = target;
+
+		unsigned int start = read_cycles();
+		int indexed = search_messages("ribbon", 6, found, SEARCH_MAX_RESULTS);
+		unsigned int index_cycles = read_cycles() - start;
+
+		start = read_cycles();
+		int scanned = 0;
+		for (unsigned int id = first_message_id; id != next_message_id; id++)
+		{
+			scanned += message_contains(get_message(id), "ribbon", 6);
+		}
+		unsigned int scan_cycles = read_cycles() - start;
+
+		printf("%u messages stored: index %d found in %u cycles, scan %d found in %u cycles\n",
+			   next_message_id - first_message_id, indexed, index_cycles, scanned, scan_cycles);
+	}
+	mark_dirty(REGION_MESSAGES);
+}
+
+void benchmark_render()
+{
+	// Cycles to rebuild the message view with 100 messages in the store
+	char text[] = "the board on the left keeps dropping the first byte of every frame, "
+				  "try swapping the ribbon cable and see if it follows the cable";
+	for (int i = 0; i < 100; i++)
+	{
+		insertMessage(i & 1 ? "dan" : "balls", text, strlen(text));
+	}
+	int count = 100;
+
+	unsigned int start = read_cycles();
+	for (int i = 0; i < count; i++)
+	{
+		clear_character_rows(5, 53);
+		printMessages();
+	}
+	unsigned int cached = read_cycles() - start;
+
+	// The old renderer: every frame it walked the whole message list newest
+	// first, and for each of the 23 messages that fit, two rows apart from
+	// row 51 up, built the row with strcat and wrote all of it
+	start = read_cycles();
+	for (int i = 0; i < count; i++)
+	{
+		clear_character_rows(5, 53);
+		int counter = 0;
+		for (unsigned int id = next_message_id; id-- != first_message_id; counter++)
+		{
+			struct MessageRecord *m = get_message(id);
+			int spacing = 51 - (counter * 2);
+			if (spacing > 51 || spacing < 7)
+			{
+				continue;
+			}
+			char message[600] = "";
+			strcat(message, sender_names[m->sender]);
+			strcat(message, " >> ");
+			strcat(message, m->text);
+			write_word(2, spacing, message);
+		}
+	}
+	unsigned int strcat_cycles = read_cycles() - start;
+
+	printf("%u messages stored\n", next_message_id - first_message_id);
+	printf("strcat render: %u cycles per frame\n", strcat_cycles / count);
+	printf("cached layout render: %u cycles per frame\n", cached / count);
+	mark_dirty(REGION_MESSAGES);
+}
+
+void benchmark_scroll()
+{
+	// Page Up from the newest message to the oldest over a few thousand
+	// short messages, rendering every page
+	const char *texts[3] = {"on my way", "see you at the lab at three",
+							"the second board is wired up, flashing it now and then we can try the new cable"};
+	for (int i = 0; i < 4000; i++)
+	{
+		insertMessage(i & 1 ? "dan" : "balls", texts[i % 3], strlen(texts[i % 3]));
+	}
+
+	scroll_offset = 0;
+	int pages = 0;
+	unsigned int total = 0;
+	unsigned int worst = 0;
+	unsigned int previous;
+	do
+	{
+		previous = scroll_offset;
+		scroll_messages(PAGE_ROWS);
+		unsigned int start = read_cycles();
+		clear_character_rows(5, 53);
+		printMessages();
+		unsigned int elapsed = read_cycles() - start;
+		total += elapsed;
+		worst = elapsed > worst ? elapsed : worst;
+		pages++;
+	} while (scroll_offset != previous);
+
+	printf("%u messages, %u rows: %d pages to the oldest, %u cycles per page, %u at most\n",
+		   next_message_id - first_message_id, total_rows - message_row[first_message_id & MESSAGE_INDEX_MASK], pages,
+		   total / pages, worst);
+	scroll_offset = 0;
+	mark_dirty(REGION_MESSAGES);
+}
+
+/* SELF-TESTS */
+// Each test prints a summary over the JTAG UART and returns true when every
+// check passes. They drive the code directly, so main calls them before the
+// interrupts are enabled.
+int test_failures;
+
+void test_check(bool passed, const char *what, int case_number)
+{
+	if (!passed)
+	{
+		if (test_failures < 10)
+		{
+			printf("  FAIL %s (case %d)\n", what, case_number);
+		}
+		test_failures++;
+	}
+}
+
+int test_frame_bytes(unsigned char type, unsigned char seq, const char *payload, int length, char *bytes)
+{
+	// The bytes frame_enqueue puts on the link. With the transmitter marked
+	// busy they stay in the ring.
+	bool active = tx_active;
+	tx_active = true;
+	tx_tail = tx_head;
+	unsigned int start = tx_head;
+	frame_enqueue(type, seq, payload, length);
+	int count = tx_head - start;
+	for (int i = 0; i < count; i++)
+	{
+		bytes[i] = tx_ring[(start + i) & TX_RING_MASK];
+	}
+	tx_tail = tx_head;
+	tx_active = active;
+	return count;
+}
+
+void test_push(const char *bytes, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		rx_push(bytes[i]);
+	}
+}
+
+void test_link_reset(void)
+{
+	rx_tail = rx_head;
+	rx_expected_seq = 0;
+	rx_last_tick = tick_count;
+	conn = 1;
+}
+
+bool test_pop_expected(struct Frame *frame, unsigned char type, unsigned char seq, const char *payload, int length)
+{
+	// The next frame out is exactly this one
+	return rx_pop_frame(frame) && frame->type == type && frame->seq == seq && frame->length == length &&
+		   memcmp(frame->payload, payload, length) == 0;
+}
+
+int test_fill_payload(char *payload, unsigned int *seed, bool binary)
+{
+	// Text that packs, or bytes of every value that do not
+	static const char text[] = "the quick brown fox jumps over the lazy dog 0123456789";
+	int length = rand_r(seed) % (FRAME_MAX_PAYLOAD + 1);
+	for (int i = 0; i < length; i++)
+	{
+		payload[i] = binary ? rand_r(seed) : text[rand_r(seed) % (sizeof(text) - 1)];
+	}
+	return length;
+}
+
+bool test_framer(void)
+{
+	char payload[FRAME_MAX_PAYLOAD], bytes[FRAME_MAX_PAYLOAD + FRAME_OVERHEAD];
+	char received[FRAME_MAX_PAYLOAD + 1];
+	struct Frame frame;
+	frame.payload = received;
+	unsigned int seed = 1;
+	test_failures = 0;
+	test_link_reset();
+
+	// Round trip: every length as text and as binary, then random ones
+	int round_trips = 0;
+	for (int length = 0; length <= FRAME_MAX_PAYLOAD; length++)
+	{
+		for (int binary = 0; binary < 2; binary++)
+		{
+			for (int i = 0; i < length; i++)
+			{
+				payload[i] = binary ? rand_r(&seed) : 'a' + i % 26;
+			}
+			unsigned char seq = rx_expected_seq;
+			test_push(bytes, test_frame_bytes(FRAME_MESSAGE, seq, payload, length, bytes));
+			test_check(test_pop_expected(&frame, FRAME_MESSAGE, seq, payload, length), "round trip", length);
+			round_trips++;
+		}
+	}
+	test_check(!rx_pop_frame(&frame) && rx_head == rx_tail, "ring empty after round trips", 0);
+
+	// A bit flipped anywhere is never delivered, and the next frame still is.
+	// Flips after the sync byte are counted as corrupt. The frames have no
+	// other sync byte, as random bytes behind one pass the CRC one time in
+	// 65536 and are then left to the sequence check.
+	int flips = 0;
+	for (int round = 0; round < 40; round++)
+	{
+		int length, count;
+		unsigned char seq = rx_expected_seq;
+		do
+		{
+			length = test_fill_payload(payload, &seed, round & 1);
+			count = test_frame_bytes(FRAME_MESSAGE, seq, payload, length, bytes);
+		} while (memchr(bytes + 1, FRAME_SYNC, count - 1) != NULL);
+		char good[FRAME_MAX_PAYLOAD + FRAME_OVERHEAD];
+		memcpy(good, bytes, count);
+		for (int position = 0; position < count; position++)
+		{
+			for (int bit = 0; bit < 8; bit++)
+			{
+				unsigned int corrupt = stats.rx_corrupt_frames;
+				bytes[position] ^= 1 << bit;
+				test_push(bytes, count);
+				test_push(good, count);
+				bytes[position] ^= 1 << bit;
+
+				rx_last_tick = tick_count - RX_STALL_TICKS; // The link has gone quiet
+				test_check(test_pop_expected(&frame, FRAME_MESSAGE, seq, payload, length), "frame after a flip",
+						   flips);
+				test_check(!rx_pop_frame(&frame), "flipped frame not delivered", flips);
+				test_check(position == 0 || stats.rx_corrupt_frames > corrupt, "flip counted", flips);
+				rx_expected_seq = seq; // The same good copy follows every flip
+				flips++;
+			}
+		}
+		rx_expected_seq = seq + 1;
+	}
+
+	// Garbage between frames, sync bytes included, is skipped
+	int resyncs = 0;
+	for (int round = 0; round < 200; round++)
+	{
+		char garbage[64];
+		int garbage_count = rand_r(&seed) % sizeof(garbage);
+		for (int i = 0; i < garbage_count; i++)
+		{
+			garbage[i] = rand_r(&seed) % 4 == 0 ? FRAME_SYNC : rand_r(&seed);
+		}
+		int length = test_fill_payload(payload, &seed, round & 1);
+		unsigned char seq = rx_expected_seq;
+		test_push(garbage, garbage_count);
+		test_push(bytes, test_frame_bytes(FRAME_MESSAGE, seq, payload, length, bytes));
+		rx_last_tick = tick_count - RX_STALL_TICKS;
+		test_check(test_pop_expected(&frame, FRAME_MESSAGE, seq, payload, length), "frame after garbage", round);
+		test_check(!rx_pop_frame(&frame), "nothing after garbage", round);
+		resyncs++;
+	}
+
+	// A frame cut short waits while the link is busy and is dropped once it goes quiet
+	int truncations = 0;
+	for (int round = 0; round < 100; round++)
+	{
+		int length = test_fill_payload(payload, &seed, round & 1);
+		unsigned char seq = rx_expected_seq;
+		int count = test_frame_bytes(FRAME_MESSAGE, seq, payload, length, bytes);
+		int cut = FRAME_HEADER_SIZE + rand_r(&seed) % (count - FRAME_HEADER_SIZE);
+		unsigned int corrupt = stats.rx_corrupt_frames;
+		test_push(bytes, cut);
+		rx_last_tick = tick_count;
+		unsigned int tail = rx_tail;
+		test_check(!rx_pop_frame(&frame) && rx_tail == tail, "cut frame waits", round);
+		rx_last_tick = tick_count - RX_STALL_TICKS;
+		test_check(!rx_pop_frame(&frame) && stats.rx_corrupt_frames > corrupt, "cut frame dropped", round);
+		test_push(bytes, count);
+		test_check(test_pop_expected(&frame, FRAME_MESSAGE, seq, payload, length), "frame after a cut", round);
+		truncations++;
+	}
+
+	printf("  %d round trips, %d bit flips, %d resyncs, %d truncations: %d failures\n", round_trips, flips, resyncs,
+		   truncations, test_failures);
+	return test_failures == 0;
+}
+
+void test_keyboard_reset(bool left_shift, bool right_shift, bool caps_lock)
+{
+	kb_break = false;
+	kb_extended = false;
+	kb_skip = 0;
+	kb_left_shift = left_shift;
+	kb_right_shift = right_shift;
+	kb_caps_lock = caps_lock;
+}
+
+int test_decode(const unsigned char *codes, int count, int case_number)
+{
+	// The key from the last code; everything before it must give nothing
+	for (int i = 0; i < count - 1; i++)
+	{
+		test_check(decode_scan_code(codes[i]) == 0, "prefix gives no key", case_number);
+	}
+	return decode_scan_code(codes[count - 1]);
+}
+
+bool test_keyboard(void)
+{
+	test_failures = 0;
+
+	// Every code behind every prefix in every shift and caps state
+	static const unsigned char prefixes[][2] = {{0}, {0xF0}, {0xE0}, {0xE0, 0xF0}, {0xF0, 0xE0}};
+	static const int prefix_lengths[] = {0, 1, 1, 2, 2};
+	int sequences = 0;
+	for (int state = 0; state < 8; state++)
+	{
+		bool left_shift = state & 1, right_shift = state & 2, caps_lock = state & 4;
+		bool shift = left_shift || right_shift;
+		for (int prefix = 0; prefix < 5; prefix++)
+		{
+			bool is_break = prefix != 0 && prefix != 2;
+			bool is_extended = prefix >= 2;
+			for (int code = 0; code < 256; code++)
+			{
+				if (code == 0xE0 || code == 0xF0 || code == 0xE1)
+				{
+					continue;
+				}
+				unsigned char codes[3];
+				memcpy(codes, prefixes[prefix], prefix_lengths[prefix]);
+				codes[prefix_lengths[prefix]] = code;
+
+				int expected = 0;
+				bool after_left = left_shift, after_right = right_shift, after_caps = caps_lock;
+				if (is_extended)
+				{
+					expected = is_break ? 0 : keymap_extended[code];
+				}
+				else if (code == 0x12)
+				{
+					after_left = !is_break;
+				}
+				else if (code == 0x59)
+				{
+					after_right = !is_break;
+				}
+				else if (code == 0x58)
+				{
+					after_caps = is_break ? caps_lock : !caps_lock;
+				}
+				else if (!is_break)
+				{
+					expected = keymap[code];
+					if (expected >= 'a' && expected <= 'z' && shift != caps_lock)
+					{
+						expected += 'A' - 'a';
+					}
+					else if (!(expected >= 'a' && expected <= 'z') && shift && keymap_shift[code] != 0)
+					{
+						expected = keymap_shift[code];
+					}
+				}
+
+				test_keyboard_reset(left_shift, right_shift, caps_lock);
+				int key = test_decode(codes, prefix_lengths[prefix] + 1, sequences);
+				test_check(key == expected, "decoded key", sequences);
+				test_check(kb_left_shift == after_left && kb_right_shift == after_right && kb_caps_lock == after_caps,
+						   "shift and caps state", sequences);
+				test_check(!kb_break && !kb_extended && kb_skip == 0, "prefixes cleared", sequences);
+				sequences++;
+			}
+		}
+	}
+
+	// The tables themselves, against the keys printed on the keyboard
+	static const struct
+	{
+		unsigned char codes[3];
+		int count;
+		int state; // 1 shift, 2 caps lock
+		int key;
+	} known[] = {
+		{{0x1C}, 1, 0, 'a'},
+		{{0x1C}, 1, 1, 'A'},
+		{{0x1C}, 1, 2, 'A'},
+		{{0x1C}, 1, 3, 'a'},
+		{{0x1A}, 1, 1, 'Z'},
+		{{0x16}, 1, 0, '1'},
+		{{0x16}, 1, 1, '!'},
+		{{0x16}, 1, 2, '1'},
+		{{0x45}, 1, 1, ')'},
+		{{0x0E}, 1, 1, '~'},
+		{{0x52}, 1, 1, '"'},
+		{{0x5D}, 1, 0, '\\'},
+		{{0x4A}, 1, 1, '?'},
+		{{0x29}, 1, 1, ' '},
+		{{0x5A}, 1, 0, KEY_ENTER},
+		{{0x66}, 1, 0, KEY_BACKSPACE},
+		{{0x76}, 1, 0, KEY_ESC},
+		{{0x70}, 1, 1, '0'},
+		{{0x7C}, 1, 0, '*'},
+		{{0x05}, 1, 0, KEY_F1},
+		{{0x83}, 1, 0, KEY_F1 + 6},
+		{{0x07}, 1, 0, KEY_F12},
+		{{0xE0, 0x75}, 2, 0, KEY_UP},
+		{{0xE0, 0x72}, 2, 0, KEY_DOWN},
+		{{0xE0, 0x6B}, 2, 0, KEY_LEFT},
+		{{0xE0, 0x74}, 2, 0, KEY_RIGHT},
+		{{0xE0, 0x6C}, 2, 0, KEY_HOME},
+		{{0xE0, 0x69}, 2, 0, KEY_END},
+		{{0xE0, 0x71}, 2, 0, KEY_DELETE},
+		{{0xE0, 0x70}, 2, 0, KEY_INSERT},
+		{{0xE0, 0x7D}, 2, 0, KEY_PAGE_UP},
+		{{0xE0, 0x7A}, 2, 0, KEY_PAGE_DOWN},
+		{{0xE0, 0x5A}, 2, 0, KEY_ENTER},
+		{{0xE0, 0x4A}, 2, 1, '/'},
+		{{0xE0, 0xF0, 0x75}, 3, 0, 0},
+	};
+	for (unsigned int i = 0; i < sizeof(known) / sizeof(known[0]); i++)
+	{
+		test_keyboard_reset(known[i].state & 1, false, known[i].state & 2);
+		test_check(test_decode(known[i].codes, known[i].count, i) == known[i].key, "known key", i);
+	}
+
+	// Typing with the modifiers pressed and released in between
+	static const unsigned char typed[] = {
+		0x12, 0x33, 0xF0, 0x33, 0xF0, 0x12, 0x24, 0x59, 0x12, 0x4B, 0xF0, 0x59, 0x4B, 0xF0, 0x12, 0x4B,
+		0x58, 0xF0, 0x58, 0x44, 0x12, 0x44, 0xF0, 0x12, 0x58, 0x16, 0xE0, 0x12, 0xE0, 0x6B, 0xE0, 0xF0,
+		0x6B, 0xE0, 0xF0, 0x12, 0x29,
+	};
+	static const int typed_keys[] = {'H', 'e', 'L', 'L', 'l', 'O', 'o', '1', KEY_LEFT, ' '};
+	int typed_count = 0;
+	test_keyboard_reset(false, false, false);
+	for (unsigned int i = 0; i < sizeof(typed); i++)
+	{
+		int key = decode_scan_code(typed[i]);
+		if (key != 0)
+		{
+			test_check(typed_count < 10 && key == typed_keys[typed_count], "typed key", typed_count);
+			typed_count++;
+		}
+	}
+	test_check(typed_count == 10, "typed key count", typed_count);
+
+	// Pause sends eight codes and no break. All of them are swallowed, and the
+	// skip ends exactly at the last one.
+	static const unsigned char pause[] = {0xE1, 0x14, 0x77, 0xE1, 0xF0, 0x14, 0xF0, 0x77};
+	test_keyboard_reset(false, false, false);
+	for (unsigned int i = 0; i < sizeof(pause); i++)
+	{
+		test_check(decode_scan_code(pause[i]) == 0 && (kb_skip > 0) == (i < sizeof(pause) - 1), "pause code", i);
+	}
+	test_check(decode_scan_code(0x1C) == 'a', "key after pause", 0);
+	test_check(!kb_left_shift && !kb_right_shift && !kb_caps_lock, "state after pause", 0);
+
+	printf("  %d prefixed sequences, %d known keys, %d typed keys: %d failures\n", sequences,
+		   (int)(sizeof(known) / sizeof(known[0])), typed_count, test_failures);
+	test_keyboard_reset(false, false, false);
+	return test_failures == 0;
+}
+
+// Back-to-back messages for the ring test
+#define TEST_RING_MESSAGES 20000
+
+int test_ring_payload(int number, char *payload)
+{
+	// The message number, then letters, 6 to 63 characters in all
+	unsigned int seed = number;
+	int length = 6 + rand_r(&seed) % 58;
+	sprintf(payload, "%05d", number);
+	for (int i = 5; i < length; i++)
+	{
+		payload[i] = 'a' + (number + i) % 26;
+	}
+	return length;
+}
+
+int test_ring_bytes(int number, char *bytes)
+{
+	char payload[64];
+	int length = test_ring_payload(number, payload);
+	return test_frame_bytes(FRAME_MESSAGE, number, payload, length, bytes);
+}
+
+bool test_ring_pop(int *delivered)
+{
+	// The next frame out must be the next one pushed
+	char expected[64], received[FRAME_MAX_PAYLOAD + 1];
+	struct Frame frame;
+	frame.payload = received;
+	if (!rx_pop_frame(&frame))
+	{
+		return false;
+	}
+	tx_tail = tx_head; // Throw away the ACK
+	int length = test_ring_payload(*delivered, expected);
+	test_check(frame.seq == (unsigned char)*delivered && frame.length == length &&
+				   memcmp(frame.payload, expected, length) == 0,
+			   "message order", *delivered);
+	(*delivered)++;
+	return true;
+}
+
+bool test_ring(void)
+{
+	char bytes[FRAME_MAX_PAYLOAD + FRAME_OVERHEAD];
+	unsigned int seed = 2;
+	test_failures = 0;
+	test_link_reset();
+
+	// Bursts of up to 32 messages go in through rx_push, as gpio_ISR stores
+	// them. A full ring holds the sender up until the main loop pops, and the
+	// main loop also catches up at random points between bursts. Every
+	// message must come out once, in order and intact.
+	unsigned int dropped = stats.rx_dropped_bytes;
+	int pushed = 0, delivered = 0, total = 0;
+	unsigned int max_fill = 0;
+	while (pushed < TEST_RING_MESSAGES)
+	{
+		int burst_end = pushed + 1 + rand_r(&seed) % 32;
+		if (burst_end > TEST_RING_MESSAGES)
+		{
+			burst_end = TEST_RING_MESSAGES;
+		}
+		for (; pushed < burst_end; pushed++)
+		{
+			int count = test_ring_bytes(pushed, bytes);
+			for (int i = 0; i < count; i++)
+			{
+				if (rx_head - rx_tail == RX_RING_SIZE)
+				{
+					test_check(test_ring_pop(&delivered), "full ring holds a whole message", pushed);
+				}
+				rx_push(bytes[i]);
+			}
+			total += count;
+			if (rx_head - rx_tail > max_fill)
+			{
+				max_fill = rx_head - rx_tail;
+			}
+		}
+		for (int pops = rand_r(&seed) % 48; pops > 0 && test_ring_pop(&delivered); pops--)
+		{
+		}
+	}
+	while (test_ring_pop(&delivered))
+	{
+	}
+	test_check(delivered == TEST_RING_MESSAGES, "all messages delivered", delivered);
+	test_check(stats.rx_dropped_bytes == dropped && rx_head == rx_tail, "nothing dropped or left over", 0);
+	printf("  %d messages, %d bytes in bursts, ring filled to %u of %d\n", delivered, total, max_fill, RX_RING_SIZE);
+
+	// With nobody popping, bytes past the ring are dropped and counted. The
+	// messages that fit whole still come out, the one cut short is dropped
+	// once the link goes quiet, and the messages after it get through.
+	dropped = stats.rx_dropped_bytes;
+	test_link_reset();
+	int whole = 0;
+	total = 0;
+	for (int number = 0; total < RX_RING_SIZE + 1000; number++)
+	{
+		int count = test_ring_bytes(number, bytes);
+		test_push(bytes, count);
+		total += count;
+		if (total <= RX_RING_SIZE)
+		{
+			whole++;
+		}
+	}
+	test_check(stats.rx_dropped_bytes - dropped == (unsigned int)(total - RX_RING_SIZE), "dropped bytes counted", 0);
+	rx_last_tick = tick_count - RX_STALL_TICKS;
+	int kept = 0;
+	while (test_ring_pop(&kept))
+	{
+	}
+	test_check(kept == whole, "whole messages kept", kept);
+	for (int number = whole; number < whole + 2; number++)
+	{
+		test_push(bytes, test_ring_bytes(number, bytes));
+	}
+	int after = whole;
+	while (test_ring_pop(&after))
+	{
+	}
+	test_check(after == whole + 2 && rx_head == rx_tail, "messages after the overflow", after);
+	printf("  overflow: %u bytes dropped, %d whole messages kept: %d failures\n", stats.rx_dropped_bytes - dropped, kept,
+		   test_failures);
+
+	test_link_reset();
+	return test_failures == 0;
+}
+
+void init_devices(void)
+{
+	log_area = LOG_HOME;
+	init_frame_buffers();
+	init_cycle_counter();
+	init_pack6();
+	init_search_index();
+
+	// Clean the display
+	clean_display();
+
+	// Self-tests, run before the interrupts are enabled
+	// test_framer();
+	// test_keyboard();
+	// test_ring();
+
+	IO_WRITE(GPIO_PTR + 1, LINK_DATA_OUT_MASK);		 // Configure GPIO direction as needed
+	IO_WRITE(GPIO_CTRL_PTR + 1, LINK_CTRL_OUT_MASK); // Strobe and acknowledge lines
+	IO_WRITE(tx_timer + 1, 0x8);					 // Keep the transmit timer stopped until a send
+	unsigned int ienable = (1 << TIMER_IRQ) | (1 << TIMER2_IRQ) | (1 << PS2_IRQ) | (1 << GPIO_IRQ);
+	IO_WRITE(PS2_PTR + 1, IO_READ(PS2_PTR + 1) | 0x1); // Configure PS2 as needed
+	NIOS2_WRITE_IENABLE(ienable);
+	NIOS2_WRITE_STATUS(1); // Enable Nios II interrupts
+	IO_WRITE(GPIO_CTRL_PTR + 2, IO_READ(GPIO_CTRL_PTR + 2) | LINK_STROBE_IN | LINK_ACK_IN); // Interrupt on edges of the strobe and acknowledge
+}
+
+/* PROGRAM STARTS HERE */
+int main(void)
+{
+	init_devices();
+	log_restore(); // History from before the reset, shown once the chat starts
+
+	// setting current cursor position
+	cursor_toggle = 1;
+	cursor_x = 172;
+	cursor_y = 116;
+
+	// Enter your name
+	enter_name();
+
+	// Say hello and wait for the answer
+	cursor_toggle = 0;
+	draw_cursor(cursor_x, cursor_y);
+	detect_connection();
+
+	// setting current cursor position
+	cursor_toggle = 1;
+	cursor_x = 64;
+	cursor_y = 224;
+
+	// Clearing screen and drawing borders/cursor
+	PROFILE_START(setup_start);
+	initial_setup();
+	PROFILE_END(HIST_FRAME, setup_start);
+	stats.ready_ticks = tick_count;
+
+	// Testing messages
+	// test_messages();
+	// benchmark_primitives();
+	// benchmark_packing();
+	// benchmark_link(200, 0);
+	// benchmark_message_store();
+	// benchmark_render();
+	// benchmark_scroll();
+	// benchmark_search();
+	// benchmark_log();
+	// benchmark_glyphs();
+
+	last_pressed = -1;
+	memset(buffer, 0, BUFFER_SIZE);
+	load_window_tick = tick_count;
+	load_window_cycles = read_cycles();
+	load_window = stats; // The first window starts here, not at reset
+
+	// Anything already waiting is picked up by the first pass
+	handle_key_event();
+	handle_rx_event();
+	redraw_dirty();
+
+	while (1)
+	{
+		// Idle until an ISR posts something, then run only its handler
+		switch (wait_for_event())
+		{
+		case EVENT_KEY:
+			handle_key_event();
+			break;
+		case EVENT_RX:
+			handle_rx_event();
+			break;
+		case EVENT_BLINK:
+			handle_blink_event();
+			break;
+		case EVENT_LINK:
+			handle_link_event();
+			break;
+		case EVENT_TICK:
+			break; // Just retries the redraw below
+		case EVENT_RETRANSMIT:
+			handle_retransmit_event();
+			break;
+#if PROFILE
+		case EVENT_PROFILE:
+			profile_drain();
+			break;
+#endif
+		}
+
+		redraw_dirty();
+	}
+
+	// main loop will be a while loop that waits for keyboard input
+	// if no keyboard input the cursor will blink
+	// when there is a keyboard input the cursor will toggle to white
+}
+
+/* HOST SIMULATION */
+// With -DHOST_BUILD each board is a forked Linux process. Its main thread is
+// the CPU running chat_main, and a simulation thread plays the devices: it
+// runs the timers, feeds scripted keystrokes to the PS/2 port, swaps the
+// pixel buffers at 60 Hz and carries the JP1/JP2 lines to the other board
+// through shared memory. Interrupts are delivered to the CPU thread as
+// SIGUSR1, and clearing the status bit blocks the signal.
+#ifdef HOST_BUILD
+#undef main
+
+#define SIM_CLOCK_HZ 100000000
+#define SIM_FRAME_PERIOD (SIM_CLOCK_HZ / 60)
+#define SIM_KEY_PERIOD (SIM_CLOCK_HZ / 500)	// Between scan codes
+#define SIM_ENTER_PAUSE (SIM_CLOCK_HZ / 2) // After each Enter, so the messages are spread out
+#define SIM_POLL_NS 10000
+#define SIM_SCRIPT_SIZE 4096
+#define SIM_REPORT_SIZE 16384
+
+struct SimTimer
+{
+	unsigned int status; // TO and RUN bits
+	unsigned int control;
+	unsigned int period;
+	unsigned int snapshot;
+	unsigned long long start;
+	unsigned long long expired; // Timeouts seen since start
+};
+
+struct SimPio
+{
+	unsigned int out;
+	unsigned int direction;
+	unsigned int mask;
+	unsigned int edges;
+	unsigned int in; // Levels driven by the other board
+};
+
+// Shared by both board processes. Each board publishes the output levels of
+// its JP1 and JP2 ports and writes its report there before exiting.
+struct SimLink
+{
+	volatile unsigned int wires[2][2];
+	char report[2][SIM_REPORT_SIZE];
+};
+
+struct SimLink *sim_link;
+int sim_board;
+pthread_t sim_cpu;
+pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile sig_atomic_t sim_in_io = 0;	// The CPU thread holds sim_lock
+volatile sig_atomic_t sim_deferred = 0; // An interrupt arrived while it did
+int sim_status = 0;
+int sim_ienable = 0;
+unsigned long long sim_epoch;
+
+struct SimTimer sim_timers[2]; // TIMER_BASE, TIMER2_BASE
+struct SimPio sim_pio[2];	   // JP1 (GPIO_CTRL_BASE), JP2 (GPIO_BASE)
+unsigned char sim_ps2_fifo[256];
+unsigned int sim_ps2_head = 0;
+unsigned int sim_ps2_tail = 0;
+unsigned int sim_ps2_control = 0;
+unsigned int sim_dma_front = 0;
+unsigned int sim_dma_back = 0;
+unsigned int sim_dma_status = 0;
+char sim_char_buffer[CHAR_ROWS * 128] __attribute__((aligned(4)));
+
+// CHATBOX_LOSS is the per mille of incoming link transfers to garble, so
+// their frames fail the CRC as if a byte had been missed. CHATBOX_LINK_TEST
+// runs benchmark_link with that many messages instead of the chat program,
+// and a second number after a comma is the size of each message.
+unsigned int sim_loss_permille = 0;
+unsigned int sim_loss_seed;
+unsigned int sim_loss_mask = 0; // XORed into the data lines until the next strobe
+int sim_link_test = 0;
+int sim_link_size = 0;
+
+// CHATBOX_SLOW_RX is the microseconds board b spends on each received
+// frame, so its ring fills and the acknowledge holds the sender back
+unsigned long long sim_rx_delay_cycles = 0;
+
+// CHATBOX_UNPLUG=from,to disconnects the cables between those times in
+// seconds, to watch the heartbeats notice and the boards reconnect
+unsigned long long sim_unplug_start = 0;
+unsigned long long sim_unplug_end = 0;
+
+// The chat log, in a file when CHATBOX_LOG is set so it outlives the run,
+// and the area benchmark_log fills instead
+char *sim_log_area;
+char *sim_log_scratch;
+
+// CHATBOX_BENCH runs the benchmarks named in it, or all of them, on board a
+// instead of the chat program
+const char *sim_bench = NULL;
+struct SimBenchmark
+{
+	const char *name;
+	void (*run)(void);
+};
+const struct SimBenchmark sim_benchmarks[] = {
+	{"primitives", benchmark_primitives}, {"packing", benchmark_packing}, {"store", benchmark_message_store},
+	{"render", benchmark_render},		  {"search", benchmark_search},	  {"log", benchmark_log},
+	{"glyphs", benchmark_glyphs},		  {"scroll", benchmark_scroll},
+};
+
+// CHATBOX_TEST runs the named self-tests, or all of them, the same way
+const char *sim_test = NULL;
+
+// Scripted scan codes, each with the cycles to wait before it
+unsigned char sim_keys[SIM_SCRIPT_SIZE];
+unsigned int sim_key_gaps[SIM_SCRIPT_SIZE];
+int sim_key_count = 0;
+int sim_key_next = 0;
+
+unsigned long long sim_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec) / (1000000000 / SIM_CLOCK_HZ) - sim_epoch;
+}
+
+void sim_begin_io(void)
+{
+	sim_in_io = 1;
+	pthread_mutex_lock(&sim_lock);
+}
+
+void sim_end_io(void)
+{
+	pthread_mutex_unlock(&sim_lock);
+	sim_in_io = 0;
+	if (sim_deferred)
+	{
+		sim_deferred = 0;
+		pthread_kill(sim_cpu, SIGUSR1);
+	}
+}
+
+void sim_timer_update(struct SimTimer *t, unsigned long long now)
+{
+	if (!(t->status & 0x2))
+	{
+		return;
+	}
+	unsigned long long expired = (now - t->start) / ((unsigned long long)t->period + 1);
+	if (expired > t->expired)
+	{
+		t->expired = expired;
+		t->status |= 0x1;
+		if (!(t->control & 0x2))
+		{
+			t->status &= ~0x2; // One-shot
+		}
+	}
+}
+
+unsigned int sim_timer_count(struct SimTimer *t, unsigned long long now)
+{
+	if (!(t->status & 0x2))
+	{
+		return t->period;
+	}
+	return t->period - (now - t->start) % ((unsigned long long)t->period + 1);
+}
+
+int sim_timer_read(struct SimTimer *t, int index)
+{
+	switch (index)
+	{
+	case 0:
+		return t->status;
+	case 1:
+		return t->control;
+	case 2:
+		return t->period & 0xFFFF;
+	case 3:
+		return t->period >> 16;
+	case 4:
+		return t->snapshot & 0xFFFF;
+	case 5:
+		return t->snapshot >> 16;
+	}
+	return 0;
+}
+
+void sim_timer_write(struct SimTimer *t, int index, unsigned int value, unsigned long long now)
+{
+	switch (index)
+	{
+	case 0:
+		t->status &= ~0x1;
+		break;
+	case 1:
+		t->control = value & 0x3;
+		if (value & 0x8)
+		{
+			t->status &= ~0x2;
+		}
+		if (value & 0x4)
+		{
+			t->status |= 0x2;
+			t->start = now;
+			t->expired = 0;
+		}
+		break;
+	case 2:
+		t->period = (t->period & 0xFFFF0000) | (value & 0xFFFF);
+		t->status &= ~0x2;
+		break;
+	case 3:
+		t->period = (t->period & 0xFFFF) | (value << 16);
+		t->status &= ~0x2;
+		break;
+	case 4:
+	case 5:
+		t->snapshot = sim_timer_count(t, now);
+		break;
+	}
+}
+
+void sim_pio_publish(int port)
+{
+	__atomic_store_n(&sim_link->wires[sim_board][port], sim_pio[port].out & sim_pio[port].direction, __ATOMIC_SEQ_CST);
+}
+
+void sim_link_poll(unsigned long long now)
+{
+	// Unplugged, the inputs keep their last levels
+	if (now >= sim_unplug_start && now < sim_unplug_end)
+	{
+		return;
+	}
+
+	// Both cables are crossed, so output bit n arrives on input bit n + 8.
+	// The strobe is read before the data it clocks.
+	int peer = !sim_board;
+	unsigned int ctrl = __atomic_load_n(&sim_link->wires[peer][0], __ATOMIC_SEQ_CST) << 8;
+	unsigned int data = __atomic_load_n(&sim_link->wires[peer][1], __ATOMIC_SEQ_CST) << 8;
+
+	if ((ctrl ^ sim_pio[0].in) & LINK_STROBE_IN)
+	{
+		bool lost = (unsigned int)(rand_r(&sim_loss_seed) % 1000) < sim_loss_permille;
+		sim_loss_mask = lost ? 0x5A5A5A5A & (LINK_DATA_OUT_MASK << 8) : 0;
+	}
+	sim_pio[1].in = data ^ sim_loss_mask;
+	sim_pio[0].edges |= (ctrl ^ sim_pio[0].in) & ~sim_pio[0].direction;
+	sim_pio[0].in = ctrl;
+}
+
+int sim_ipending_locked(void)
+{
+	int pending = 0;
+	if ((sim_timers[0].status & 0x1) && (sim_timers[0].control & 0x1))
+	{
+		pending |= 1 << TIMER_IRQ;
+	}
+	if ((sim_timers[1].status & 0x1) && (sim_timers[1].control & 0x1))
+	{
+		pending |= 1 << TIMER2_IRQ;
+	}
+	if (sim_pio[0].edges & sim_pio[0].mask)
+	{
+		pending |= 1 << GPIO_IRQ;
+	}
+	if (sim_ps2_head != sim_ps2_tail && (sim_ps2_control & 0x1))
+	{
+		pending |= 1 << PS2_IRQ;
+	}
+	return pending & sim_ienable;
+}
+
+int sim_read(volatile int *reg)
+{
+	unsigned long address = (unsigned long)reg;
+	int index = (address & 0x1F) >> 2;
+	int value = 0;
+	unsigned long long now = sim_now();
+
+	sim_begin_io();
+	sim_timer_update(&sim_timers[0], now);
+	sim_timer_update(&sim_timers[1], now);
+	switch (address & ~0x1FUL)
+	{
+	case TIMER_BASE:
+		value = sim_timer_read(&sim_timers[0], index);
+		break;
+	case TIMER2_BASE:
+		value = sim_timer_read(&sim_timers[1], index);
+		break;
+	case GPIO_CTRL_BASE & ~0x1F:
+	{
+		struct SimPio *pio = &sim_pio[address >= GPIO_BASE];
+		unsigned int fields[4] = {(pio->out & pio->direction) | (pio->in & ~pio->direction), pio->direction, pio->mask, pio->edges};
+		value = fields[index & 0x3];
+		break;
+	}
+	case PS2_BASE:
+		if (index == 0 && sim_ps2_head != sim_ps2_tail)
+		{
+			value = 0x8000 | sim_ps2_fifo[sim_ps2_tail & 0xFF] | ((sim_ps2_head - sim_ps2_tail - 1) << 16);
+			sim_ps2_tail++;
+		}
+		else if (index == 1)
+		{
+			value = sim_ps2_control | (sim_ps2_head != sim_ps2_tail ? 0x100 : 0);
+		}
+		break;
+	case PIXEL_BUFFER_BASE & ~0x1F:
+		if (address < CHARACTER_BUFFER_BASE)
+		{
+			unsigned int fields[4] = {sim_dma_front, sim_dma_back, (SCREEN_HEIGHT << 16) | SCREEN_WIDTH, sim_dma_status};
+			value = fields[index & 0x3];
+		}
+		else
+		{
+			value = (int)(unsigned long)sim_char_buffer;
+		}
+		break;
+	}
+	sim_end_io();
+	return value;
+}
+
+void sim_write(volatile int *reg, int value)
+{
+	unsigned long address = (unsigned long)reg;
+	int index = (address & 0x1F) >> 2;
+	unsigned long long now = sim_now();
+
+	sim_begin_io();
+	sim_timer_update(&sim_timers[0], now);
+	sim_timer_update(&sim_timers[1], now);
+	switch (address & ~0x1FUL)
+	{
+	case TIMER_BASE:
+		sim_timer_write(&sim_timers[0], index, value, now);
+		break;
+	case TIMER2_BASE:
+		sim_timer_write(&sim_timers[1], index, value, now);
+		break;
+	case GPIO_CTRL_BASE & ~0x1F:
+	{
+		int port = address >= GPIO_BASE;
+		struct SimPio *pio = &sim_pio[port];
+		switch (index & 0x3)
+		{
+		case 0:
+			pio->out = value;
+			sim_pio_publish(port);
+			break;
+		case 1:
+			pio->direction = value;
+			sim_pio_publish(port);
+			break;
+		case 2:
+			pio->mask = value;
+			break;
+		case 3:
+			pio->edges &= ~value; // Write one to clear
+			break;
+		}
+		break;
+	}
+	case PS2_BASE:
+		if (index == 1)
+		{
+			sim_ps2_control = value & 0x1;
+		}
+		break;
+	case PIXEL_BUFFER_BASE & ~0x1F:
+		if (index == 0)
+		{
+			sim_dma_status |= 0x1; // Swap at the next vertical blank
+		}
+		else if (index == 1)
+		{
+			sim_dma_back = value;
+		}
+		break;
+	}
+	int pending = sim_ipending_locked();
+	sim_end_io();
+
+	// A write that raises an interrupt, like acknowledging into a ready peer
+	if (pending)
+	{
+		pthread_kill(sim_cpu, SIGUSR1);
+	}
+}
+
+void sim_write_status(int status)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sim_status = status & 0x1;
+	pthread_sigmask(sim_status ? SIG_UNBLOCK : SIG_BLOCK, &set, NULL);
+}
+
+void sim_write_ienable(int ienable)
+{
+	sim_ienable = ienable;
+	pthread_kill(sim_cpu, SIGUSR1); // Anything already pending
+}
+
+int sim_read_ipending(void)
+{
+	unsigned long long now = sim_now();
+	sim_begin_io();
+	sim_timer_update(&sim_timers[0], now);
+	sim_timer_update(&sim_timers[1], now);
+	int pending = sim_ipending_locked();
+	sim_end_io();
+	return pending;
+}
+
+void sim_interrupt(int signal)
+{
+	(void)signal;
+
+	// The handler runs with SIGUSR1 blocked, like an ISR with PIE cleared
+	if (sim_in_io)
+	{
+		sim_deferred = 1;
+		return;
+	}
+	while (sim_read_ipending())
+	{
+		interrupt_handler();
+	}
+}
+
+void sim_add_key(unsigned char code, unsigned int gap)
+{
+	if (sim_key_count < SIM_SCRIPT_SIZE)
+	{
+		sim_keys[sim_key_count] = code;
+		sim_key_gaps[sim_key_count] = gap;
+		sim_key_count++;
+	}
+}
+
+void sim_load_script(const char *script)
+{
+	// Turns text into set 2 make and break codes. A newline, or a backslash
+	// and n as typed on a command line, presses Enter.
+	unsigned int gap = SIM_CLOCK_HZ / 4; // Let the board start first
+	for (; *script; script++)
+	{
+		char c = *script;
+		if (c == '\\' && script[1] == 'n')
+		{
+			script++;
+			c = '\n';
+		}
+		if (c == '\n')
+		{
+			c = KEY_ENTER;
+		}
+		bool shift = false;
+		int code = 0;
+		for (int i = 1; i < 256 && code == 0; i++)
+		{
+			if (keymap[i] == (unsigned char)c || (c >= 'A' && c <= 'Z' && keymap[i] == c - 'A' + 'a'))
+			{
+				code = i;
+				shift = c >= 'A' && c <= 'Z';
+			}
+			else if (keymap_shift[i] == (unsigned char)c)
+			{
+				code = i;
+				shift = true;
+			}
+		}
+		if (code == 0)
+		{
+			continue;
+		}
+
+		if (shift)
+		{
+			sim_add_key(0x12, gap);
+			gap = SIM_KEY_PERIOD;
+		}
+		sim_add_key(code, gap);
+		sim_add_key(0xF0, SIM_KEY_PERIOD);
+		sim_add_key(code, SIM_KEY_PERIOD);
+		if (shift)
+		{
+			sim_add_key(0xF0, SIM_KEY_PERIOD);
+			sim_add_key(0x12, SIM_KEY_PERIOD);
+		}
+		gap = c == KEY_ENTER ? SIM_ENTER_PAUSE : SIM_KEY_PERIOD;
+	}
+}
+
+void sim_dump_ppm(const char *prefix)
+{
+	// The front pixel buffer as seen on the VGA output, without the text layer
+	char path[256];
+	snprintf(path, sizeof(path), "%s-%c.ppm", prefix, 'a' + sim_board);
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		return;
+	}
+	fprintf(file, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+	short int *front = (short int *)(unsigned long)sim_dma_front;
+	for (int y = 0; y < SCREEN_HEIGHT; y++)
+	{
+		for (int x = 0; x < SCREEN_WIDTH; x++)
+		{
+			unsigned short pixel = front[(y << 9) + x];
+			unsigned char rgb[3] = {(pixel >> 11) << 3, ((pixel >> 5) & 0x3F) << 2, (pixel & 0x1F) << 3};
+			fwrite(rgb, 1, 3, file);
+		}
+	}
+	fclose(file);
+}
+
+void sim_rx_delay(void)
+{
+	// Away from the ring with interrupts on, as in a long redraw. Sleeping
+	// leaves the CPU to the other board when there is only one.
+	if (sim_board == 1 && sim_rx_delay_cycles > 0)
+	{
+		unsigned long long until = sim_now() + sim_rx_delay_cycles;
+		struct timespec poll = {0, SIM_POLL_NS};
+		while (sim_now() < until)
+		{
+			nanosleep(&poll, NULL);
+		}
+	}
+}
+
+void sim_report(void)
+{
+	// The character screen and the counters, printed by the parent process
+	char *report = sim_link->report[sim_board];
+	int length = 0;
+	length += snprintf(report + length, SIM_REPORT_SIZE - length, "board %c:\n", 'a' + sim_board);
+	for (int y = 0; y < CHAR_ROWS; y++)
+	{
+		char line[CHAR_COLUMNS + 1];
+		int end = 0;
+		for (int x = 0; x < CHAR_COLUMNS; x++)
+		{
+			char c = sim_char_buffer[(y << 7) + x];
+			line[x] = c ? c : ' ';
+			if (c && c != ' ')
+			{
+				end = x + 1;
+			}
+		}
+		line[end] = 0;
+		if (end > 0)
+		{
+			length += snprintf(report + length, SIM_REPORT_SIZE - length, "%2d |%s\n", y, line);
+		}
+	}
+	snprintf(report + length, SIM_REPORT_SIZE - length,
+			 "frames %u, max frame %u cycles, rx %u frames (%u corrupt, %u dropped bytes, %u ack stalls), "
+			 "tx %u bytes in %u transfers, %u ack timeouts, %u frames resent, %u duplicates, idle %u%%, %u events/s, "
+			 "%u messages restored in %u cycles, %u connects, %u link drops, ready at %u ms\n",
+			 stats.frames_drawn, stats.max_frame_cycles, stats.rx_frames, stats.rx_corrupt_frames,
+			 stats.rx_dropped_bytes, stats.rx_ack_stalls, stats.tx_bytes_sent, stats.tx_transfers,
+			 stats.tx_ack_timeouts, stats.tx_retransmits, stats.rx_duplicates, stats.idle_percent,
+			 stats.events_per_second, stats.log_restored, stats.log_restore_cycles, stats.link_connects,
+			 stats.link_drops, stats.ready_ticks * 1000 / TICKS_PER_SECOND);
+}
+
+#if PROFILE
+void profile_drain(void)
+{
+	// Histograms go into the report the parent prints to stdout
+	char *report = sim_link->report[sim_board];
+	int length = strlen(report);
+	while (profile_out_tail != profile_out_head && length < SIM_REPORT_SIZE - 1)
+	{
+		report[length++] = profile_out[profile_out_tail++ & PROFILE_OUT_MASK];
+	}
+	report[length] = 0;
+}
+#endif
+
+void *sim_thread(void *arg)
+{
+	unsigned long long end = *(unsigned long long *)arg;
+	const char *ppm_prefix = getenv("CHATBOX_PPM");
+	unsigned long long next_frame = SIM_FRAME_PERIOD;
+	unsigned long long next_key = sim_key_count > 0 ? sim_key_gaps[0] : 0;
+	struct timespec poll = {0, SIM_POLL_NS};
+
+	while (1)
+	{
+		nanosleep(&poll, NULL);
+		unsigned long long now = sim_now();
+
+		pthread_mutex_lock(&sim_lock);
+		sim_timer_update(&sim_timers[0], now);
+		sim_timer_update(&sim_timers[1], now);
+		sim_link_poll(now);
+		if (now >= next_frame)
+		{
+			next_frame += SIM_FRAME_PERIOD;
+			if (sim_dma_status & 0x1)
+			{
+				unsigned int front = sim_dma_front;
+				sim_dma_front = sim_dma_back;
+				sim_dma_back = front;
+				sim_dma_status &= ~0x1;
+			}
+		}
+		if (sim_key_next < sim_key_count && now >= next_key && sim_ps2_head - sim_ps2_tail < 256)
+		{
+			sim_ps2_fifo[sim_ps2_head++ & 0xFF] = sim_keys[sim_key_next++];
+			next_key = now + (sim_key_next < sim_key_count ? sim_key_gaps[sim_key_next] : 0);
+		}
+		int pending = sim_ipending_locked();
+		if (now >= end)
+		{
+			sim_report();
+#if PROFILE
+			profile_dump();
+			profile_drain();
+#endif
+			if (ppm_prefix != NULL)
+			{
+				sim_dump_ppm(ppm_prefix);
+			}
+			_exit(sim_link_test > 0 || sim_bench != NULL || sim_test != NULL); // A test still running has timed out
+		}
+		pthread_mutex_unlock(&sim_lock);
+
+		if (pending)
+		{
+			pthread_kill(sim_cpu, SIGUSR1);
+		}
+	}
+	return NULL;
+}
+
+void sim_open_log(const char *prefix)
+{
+	if (prefix != NULL)
+	{
+		char path[256];
+		snprintf(path, sizeof(path), "%s-%c.log", prefix, 'a' + sim_board);
+		int fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (fd >= 0 && ftruncate(fd, LOG_SIZE) == 0)
+		{
+			sim_log_area = mmap(NULL, LOG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			close(fd);
+			if (sim_log_area != MAP_FAILED)
+			{
+				return;
+			}
+		}
+		fprintf(stderr, "cannot map %s, the log will not be kept\n", path);
+	}
+	sim_log_area = calloc(1, LOG_SIZE);
+}
+
+bool sim_run_benchmarks(const char *names)
+{
+	// False when nothing in names is a benchmark
+	bool found = false;
+	init_devices();
+	for (unsigned int i = 0; i < sizeof(sim_benchmarks) / sizeof(sim_benchmarks[0]); i++)
+	{
+		if (strcmp(names, "all") == 0 || strstr(names, sim_benchmarks[i].name) != NULL)
+		{
+			printf("%s:\n", sim_benchmarks[i].name);
+			sim_benchmarks[i].run();
+			found = true;
+		}
+	}
+	return found;
+}
+
+struct SimTest
+{
+	const char *name;
+	bool (*run)(void);
+};
+const struct SimTest sim_tests[] = {
+	{"framer", test_framer},
+	{"keyboard", test_keyboard},
+	{"ring", test_ring},
+};
+
+bool sim_run_tests(const char *names)
+{
+	// False when a test fails or nothing in names is a test
+	bool found = false;
+	bool passed = true;
+	init_pack6();
+	for (unsigned int i = 0; i < sizeof(sim_tests) / sizeof(sim_tests[0]); i++)
+	{
+		if (strcmp(names, "all") == 0 || strstr(names, sim_tests[i].name) != NULL)
+		{
+			printf("%s:\n", sim_tests[i].name);
+			passed = sim_tests[i].run() && passed;
+			found = true;
+		}
+	}
+	return found && passed;
+}
+
+void sim_run_board(int board, const char *script, unsigned long long end)
+{
+	sim_board = board;
+	sim_cpu = pthread_self();
+	sim_load_script(script);
+	sim_loss_seed = board + 1;
+	sim_open_log(getenv("CHATBOX_LOG"));
+	sim_log_scratch = calloc(1, LOG_SIZE);
+	setvbuf(stdout, NULL, _IOLBF, 0); // Test and benchmark output survives _exit
+
+	// The DMA controller keeps buffer addresses in 32-bit registers
+	if ((unsigned long)&Buffer2 > 0x7FFFFFFF || (unsigned long)sim_char_buffer > 0x7FFFFFFF)
+	{
+		fprintf(stderr, "frame buffers are above 2 GB, build with -no-pie\n");
+		_exit(1);
+	}
+
+	// Interrupts start masked, as after a reset
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = sim_interrupt;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, NULL);
+	sim_write_status(0);
+
+	// The simulation thread inherits the blocked mask and never takes the signal
+	pthread_t thread;
+	pthread_create(&thread, NULL, sim_thread, &end);
+	if (sim_bench != NULL)
+	{
+		_exit(board == 0 && !sim_run_benchmarks(sim_bench));
+	}
+	if (sim_test != NULL)
+	{
+		_exit(board == 0 && !sim_run_tests(sim_test));
+	}
+	if (sim_link_test > 0)
+	{
+		init_devices();
+		bool passed = benchmark_link(sim_link_test, sim_link_size);
+		pthread_mutex_lock(&sim_lock);
+		sim_report();
+		_exit(!passed);
+	}
+	chat_main();
+	_exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	// chatbox [seconds] [board a keys] [board b keys]
+	double seconds = argc > 1 ? atof(argv[1]) : 5;
+	const char *scripts[2] = {
+		argc > 2 ? argv[2] : "alice\nhi bob, are you there?\n",
+		argc > 3 ? argv[3] : "bob\nHello Alice! The link works.\n",
+	};
+
+	const char *loss = getenv("CHATBOX_LOSS");
+	const char *link_test = getenv("CHATBOX_LINK_TEST");
+	sim_loss_permille = loss != NULL ? atoi(loss) : 0;
+	if (link_test != NULL)
+	{
+		sscanf(link_test, "%d,%d", &sim_link_test, &sim_link_size);
+	}
+	sim_bench = getenv("CHATBOX_BENCH");
+	sim_test = getenv("CHATBOX_TEST");
+	const char *slow_rx = getenv("CHATBOX_SLOW_RX");
+	sim_rx_delay_cycles = slow_rx != NULL ? atof(slow_rx) * (SIM_CLOCK_HZ / 1000000) : 0;
+	double unplug[2];
+	const char *unplug_window = getenv("CHATBOX_UNPLUG");
+	if (unplug_window != NULL && sscanf(unplug_window, "%lf,%lf", &unplug[0], &unplug[1]) == 2)
+	{
+		sim_unplug_start = unplug[0] * SIM_CLOCK_HZ;
+		sim_unplug_end = unplug[1] * SIM_CLOCK_HZ;
+	}
+
+	sim_link = mmap(NULL, sizeof(struct SimLink), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	memset(sim_link, 0, sizeof(struct SimLink));
+	sim_epoch = sim_now();
+	unsigned long long end = seconds * SIM_CLOCK_HZ;
+
+	pid_t boards[2];
+	for (int board = 0; board < 2; board++)
+	{
+		boards[board] = fork();
+		if (boards[board] == 0)
+		{
+			sim_run_board(board, scripts[board], end);
+		}
+	}
+
+	int failed = 0;
+	for (int board = 0; board < 2; board++)
+	{
+		int status;
+		waitpid(boards[board], &status, 0);
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+		fputs(sim_link->report[board], stdout);
+	}
+	return failed;
 }
+#endif